@@ -56,9 +56,10 @@ void setup() {
   // The following line 'wipes' the external EEPROM and prepares
   // it for use. Uncomment it, upload the sketch, then comment it back
   // in again and upload again, if you use a new EEPROM.
-  // writeExtEEPROM(0,0); writeExtEEPROM(1,0);
+  // The last byte is the generation of the file list, see host.cpp.
+  // writeExtEEPROM(0,0); writeExtEEPROM(1,0); writeExtEEPROM(EXTERNAL_EEPROM_SIZE-1,0);
 
-  if (EEPROM.read(0) == MAGIC_AUTORUN_NUMBER)
+  if (host_autorun())
     autorun = 1;
   else
     host_startupTone();
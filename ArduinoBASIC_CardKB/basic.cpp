@@ -8,7 +8,11 @@
    sound & system variables).
 
    Notes
-    - All numbers (except line numbers) are floats internally
+    - All numbers (except line numbers) are floats internally, apart from
+       integer variables (name ending in %, e.g. a%) which are 32 bit. Sums
+       involving only integers and whole number constants are done in
+       integers, and switch to floats if the result would overflow.
+       / always gives a float. Assigning a float to a% truncates it.
     - Multiple commands are allowed per line, seperated by :
     - LET is optional e.g. LET a = 6: b = 7
     - MOD provides the modulo operator which was missing from Sinclair BASIC.
@@ -26,13 +30,14 @@
     - RND is a nonary operator not a function i.e. RND not RND()
     - PRINT AT x,y ... is replaced by POSITION x,y : PRINT ...
     - LIST takes an optional start and end e.g. LIST 1,100 or LIST 50
-    - INKEY$ reads the last key pressed from the keyboard, or an empty string
+    - INKEY$ reads the next key typed on the keyboard, or an empty string
        if no key pressed. The (single key) buffer is emptied after the call.
        e.g. a$ = INKEY$
     - LOAD/SAVE load and save the current program to the EEPROM (1k limit).
        SAVE+ will set the auto-run flag, which loads the program automatically
        on boot. With a filename e.g. SAVE "test" saves to an external EEPROM.
     - DIR/DELETE "filename" - list and remove files from external EEPROM.
+       COMPACT reuses the space of deleted files (SAVE does it when full).
     - PINMODE <pin>, <mode> - sets the pin mode (0=input, 1=output, 2=pullup)
     - PIN <pin>, <state> - sets the pin high (non zero) or low (zero)
     - PINREAD(pin) returns pin value, ANALOGRD(pin) for analog pins
@@ -97,6 +102,7 @@ const char string_21[] PROGMEM = "Bad array index";
 const char string_22[] PROGMEM = "Bad string index";
 const char string_23[] PROGMEM = "Error in VAL input";
 const char string_24[] PROGMEM = "Bad parameter";
+const char string_25[] PROGMEM = "Overflow";
 
 //PROGMEM const char *errorTable[] = {
 const char* const errorTable[] PROGMEM = {
@@ -106,7 +112,7 @@ const char* const errorTable[] PROGMEM = {
   string_12, string_13, string_14, string_15,
   string_16, string_17, string_18, string_19,
   string_20, string_21, string_22, string_23,
-  string_24
+  string_24, string_25
 };
 
 // Token flags
@@ -148,21 +154,136 @@ const TokenTableEntry PROGMEM tokenTable[] = {
   {"PINREAD", 1}, {"ANALOGRD", 1},
   {"DIR", TKN_FMT_POST}, {"DELETE", TKN_FMT_POST},
   {"SIN", 1}, {"COS", 1}, {"TAN", 1}, {"EXP", 1}, {"SQRT", 1}, {"LOG", 1},
-  {"IMG", TKN_FMT_POST}
+  {"IMG", TKN_FMT_POST},
+  {"REFRESH", TKN_FMT_POST}, {"FLUSH", TKN_FMT_POST},
+  {"PLOT", TKN_FMT_POST}, {"UNPLOT", TKN_FMT_POST}, {"LINE", TKN_FMT_POST}, {"RECT", TKN_FMT_POST},
+  {"POINT", 2},
+  {"SPRITE", TKN_FMT_POST}, {"AT", TKN_FMT_PRE | TKN_FMT_POST}, {"HIT", 2},
+  {"COMPACT", TKN_FMT_POST}
+};
+
+// Keywords grouped by their first letter, so the lexer only compares an
+// identifier with the few keywords starting the same way.
+// Keep these two tables in step with tokenTable when adding a keyword.
+const uint8_t PROGMEM keywordTokens[] = {
+  TOKEN_ANALOGRD, TOKEN_AND, TOKEN_AT,	// A
+  TOKEN_CLS, TOKEN_COMPACT, TOKEN_CONT, TOKEN_COS,	// C
+  TOKEN_DELETE, TOKEN_DIM, TOKEN_DIR,	// D
+  TOKEN_EXP,	// E
+  TOKEN_FLUSH, TOKEN_FOR,	// F
+  TOKEN_GOSUB, TOKEN_GOTO,	// G
+  TOKEN_HIT,	// H
+  TOKEN_IF, TOKEN_IMG, TOKEN_INKEY, TOKEN_INPUT, TOKEN_INT,	// I
+  TOKEN_LEFT, TOKEN_LEN, TOKEN_LET, TOKEN_LINE, TOKEN_LIST, TOKEN_LOAD, TOKEN_LOG,	// L
+  TOKEN_MID, TOKEN_MOD,	// M
+  TOKEN_NEW, TOKEN_NEXT, TOKEN_NOT,	// N
+  TOKEN_OR,	// O
+  TOKEN_PAUSE, TOKEN_PIN, TOKEN_PINMODE, TOKEN_PINREAD, TOKEN_PLOT, TOKEN_POINT, TOKEN_POSITION, TOKEN_PRINT,	// P
+  TOKEN_RECT, TOKEN_REFRESH, TOKEN_REM, TOKEN_RETURN, TOKEN_RIGHT, TOKEN_RND, TOKEN_RUN,	// R
+  TOKEN_SAVE, TOKEN_SIN, TOKEN_SPRITE, TOKEN_SQRT, TOKEN_STEP, TOKEN_STOP, TOKEN_STR,	// S
+  TOKEN_TAN, TOKEN_THEN, TOKEN_TO,	// T
+  TOKEN_UNPLOT,	// U
+  TOKEN_VAL	// V
+};
+
+// where each letter's keywords start in keywordTokens (A to Z, then the end)
+const uint8_t PROGMEM keywordStart[27] = {
+  0, 3, 3, 7, 10, 11, 13, 15, 16, 21, 21, 21, 28,	// A-M
+  30, 33, 34, 42, 42, 49, 56, 59, 60, 61, 61, 61, 61,	// N-Z
+  61
 };
 
 
 /* **************************************************************************
    PROGRAM FUNCTIONS
  * **************************************************************************/
+
+// bytes taken by the token at p, including anything following it inline
+int tokenLength(uint8_t *p) {
+  uint8_t *q = p + 1;
+  switch (*p) {
+    case TOKEN_IDENT:
+      while (*q++ < 0x80);
+      return q - p;
+    case TOKEN_NUMBER:
+      return 1 + sizeof(float);
+    case TOKEN_INTEGER:
+      return 1 + sizeof(long);
+    case TOKEN_STRING:
+      return 2 + strlen((char*)q);
+    case TOKEN_BYTE:
+    case TOKEN_NAME:
+      return 2;
+    case TOKEN_WORD:
+      return 1 + sizeof(uint16_t);
+    default:
+      return 1;
+  }
+}
+
+// Identifiers in stored lines are kept once in a name table, which is held as
+// a pseudo line 0 at the start of the program so that SAVE and LOAD carry it
+// +--------+--------+------+------+ . . .
+// | length | 0      | name | name |  each name as after TOKEN_IDENT
+// | 2bytes | 2bytes |      |      |  (last char + 0x80)
+// +--------+--------+------+------+ . . .
+// Lines refer to a name with TOKEN_NAME and its 1 byte offset in the table.
+// Names stay in the table until NEW or LOAD.
+#define NAME_TABLE_START    4
+#define NAME_TABLE_MAX      255	// largest offset a TOKEN_NAME can hold
+
+// bytes used by the name table line, 0 if the program has none
+uint16_t nameTableLen() {
+  if (sysPROGEND && *(uint16_t*)&mem[2] == 0)
+    return *(uint16_t*)&mem[0];
+  return 0;
+}
+
+// offset of the name in the table, adding it if needed - or -1 if it won't fit
+// (reserve is the memory to leave free for the line being stored)
+int nameTableOffset(uint8_t *name, int nameLen, int reserve) {
+  uint16_t tableLen = nameTableLen();
+  uint8_t *p = &mem[NAME_TABLE_START];
+  while (p < &mem[tableLen]) {
+    uint8_t *q = p;
+    while (*q++ < 0x80);
+    if (q - p == nameLen && memcmp(p, name, nameLen) == 0)
+      return p - &mem[NAME_TABLE_START];
+    p = q;
+  }
+  // add it to the end of the table, moving the program up
+  bool newTable = (tableLen == 0);
+  if (newTable)
+    tableLen = NAME_TABLE_START;
+  if (tableLen - NAME_TABLE_START > NAME_TABLE_MAX)
+    return -1;
+  int bytesNeeded = (newTable ? NAME_TABLE_START : 0) + nameLen;
+  if (sysPROGEND + bytesNeeded + reserve > sysVARSTART)
+    return -1;
+  p = newTable ? &mem[0] : &mem[tableLen];
+  memmove(p + bytesNeeded, p, &mem[sysPROGEND] - p);
+  sysPROGEND += bytesNeeded;
+  *(uint16_t*)&mem[0] = tableLen + nameLen;
+  *(uint16_t*)&mem[2] = 0;
+  memcpy(&mem[tableLen], name, nameLen);
+  return tableLen - NAME_TABLE_START;
+}
+
 void printTokens(uint8_t *p) {
   bool modeREM = false;
   while (*p != TOKEN_EOL) {
-    if (*p == TOKEN_IDENT) {
-      p++;
-      while (*p < 0x80)
-        host_outputChar(*p++);
-      host_outputChar((*p++) - 0x80);
+    if (*p == TOKEN_IDENT || *p == TOKEN_NAME) {
+      uint8_t *name = p + 1;
+      if (*p == TOKEN_NAME)
+        name = &mem[NAME_TABLE_START + p[1]];
+      while (*name < 0x80)
+        host_outputChar(*name++);
+      host_outputChar(*name - 0x80);
+      p += tokenLength(p);
+    }
+    else if (*p == TOKEN_BYTE || *p == TOKEN_WORD) {
+      host_outputInt(*p == TOKEN_BYTE ? p[1] : *(uint16_t*)(p + 1));
+      p += tokenLength(p);
     }
     else if (*p == TOKEN_NUMBER) {
       p++;
@@ -208,7 +329,7 @@ void listProg(uint16_t first, uint16_t last) {
   uint8_t *p = &mem[0];
   while (p < &mem[sysPROGEND]) {
     uint16_t lineNum = *(uint16_t*)(p + 2);
-    if ((!first || lineNum >= first) && (!last || lineNum <= last)) {
+    if (lineNum && (!first || lineNum >= first) && (!last || lineNum <= last)) {
       host_outputInt(lineNum);
       host_outputChar(' ');
       printTokens(p + 4);
@@ -218,7 +339,70 @@ void listProg(uint16_t first, uint16_t last) {
   }
 }
 
+// Line index sits directly after the program and is rebuilt lazily after an edit
+// (followed by the compiled expressions, see EXPRESSION COMPILER)
+// +--------+--------+ . . .
+// | offset | offset |  offset of each line in mem, in line number order
+// | 2bytes | 2bytes |
+// +--------+--------+ . . .
+static uint16_t lineIndexCount;	// number of lines in the index, 0 = no index
+static bool lineIndexTried;	// set once a build has been attempted for this program
+static uint16_t progIndexLen;	// bytes used after the program by the index and compiled code
+static uint16_t compiledCount;	// number of compiled expressions
+
+void invalidateLineIndex() {
+  lineIndexCount = 0;
+  lineIndexTried = false;
+  progIndexLen = 0;
+  compiledCount = 0;
+}
+
+// bumped whenever the program or the input buffer changes, so that stored
+// statement offsets (for/next and gosub) can be checked before they are used
+static uint16_t progGeneration;
+
+void programChanged() {
+  invalidateLineIndex();
+  progGeneration++;
+}
+
+// must only be called while the calculator stack is empty
+void buildLineIndex() {
+  invalidateLineIndex();
+  lineIndexTried = true;
+  uint16_t numLines = 0;
+  uint8_t *p = &mem[0];
+  while (p < &mem[sysPROGEND]) {
+    numLines++;
+    p += *(uint16_t *)p;
+  }
+  if (sysPROGEND + numLines * (int)sizeof(uint16_t) > sysVARSTART)
+    return;	// no room, jumps fall back to scanning the program
+  uint16_t *index = (uint16_t*)&mem[sysPROGEND];
+  p = &mem[0];
+  while (p < &mem[sysPROGEND]) {
+    *index++ = p - &mem[0];
+    p += *(uint16_t *)p;
+  }
+  lineIndexCount = numLines;
+  progIndexLen = numLines * sizeof(uint16_t);
+  sysSTACKSTART = sysSTACKEND = sysPROGEND + progIndexLen;
+}
+
 uint8_t *findProgLine(uint16_t targetLineNumber) {
+  if (lineIndexCount) {
+    // binary search for the first line at or after the target
+    uint16_t *index = (uint16_t*)&mem[sysPROGEND];
+    uint16_t lo = 0, hi = lineIndexCount;
+    while (lo < hi) {
+      uint16_t mid = (lo + hi) >> 1;
+      if (*(uint16_t*)&mem[index[mid] + 2] < targetLineNumber)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return (lo < lineIndexCount) ? &mem[index[lo]] : &mem[sysPROGEND];
+  }
   uint8_t *p = &mem[0];
   while (p < &mem[sysPROGEND]) {
     uint16_t lineNum = *(uint16_t*)(p + 2);
@@ -230,13 +414,44 @@ uint8_t *findProgLine(uint16_t targetLineNumber) {
 }
 
 void deleteProgLine(uint8_t *p) {
+  programChanged();
   uint16_t lineLen = *(uint16_t*)p;
   sysPROGEND -= lineLen;
   memmove(p, p + lineLen, &mem[sysPROGEND] - p);
 }
 
+// swap the identifiers in a line about to be stored for name table references
+// returns the new length of the line's tokens
+int useNameTable(uint8_t *tokens, int tokensLength) {
+  uint8_t *in = tokens, *out = tokens;
+  while (1) {
+    uint8_t tok = *in;
+    int len = tokenLength(in);
+    int offset = -1;
+    // a single letter name takes no more room inline than as a reference
+    if (tok == TOKEN_IDENT && len > 2)
+      offset = nameTableOffset(in + 1, len - 1, 4 + tokensLength);
+    if (offset >= 0) {
+      *out++ = TOKEN_NAME;
+      *out++ = offset;
+    }
+    else {
+      memmove(out, in, len);
+      out += len;
+    }
+    in += len;
+    if (tok == TOKEN_EOL)
+      return out - tokens;
+  }
+}
+
+void clearVarSlots();	// see VARIABLE TABLE FUNCTIONS
+
 int doProgLine(uint16_t lineNumber, uint8_t* tokenPtr, int tokensLength)
 {
+  // adding names moves the program, so do it before finding the line
+  programChanged();
+  tokensLength = useNameTable(tokenPtr, tokensLength);
   // find line of the at or immediately after the number
   uint8_t *p = findProgLine(lineNumber);
   uint16_t foundLine = 0;
@@ -246,8 +461,14 @@ int doProgLine(uint16_t lineNumber, uint8_t* tokenPtr, int tokensLength)
   if (foundLine == lineNumber)
     deleteProgLine(p);
   // now check to see if this is an empty line, if so don't insert it
-  if (*tokenPtr == TOKEN_EOL)
+  if (*tokenPtr == TOKEN_EOL) {
+    // the name table isn't worth keeping without any lines
+    if (sysPROGEND == nameTableLen()) {
+      sysPROGEND = 0;
+      clearVarSlots();	// its offsets will be given to other names
+    }
     return 1;
+  }
   // we now need to insert the new line at p
   int bytesNeeded = 4 + tokensLength;	// length, linenum + tokens
   if (sysPROGEND + bytesNeeded > sysVARSTART)
@@ -268,12 +489,12 @@ int doProgLine(uint16_t lineNumber, uint8_t* tokenPtr, int tokensLength)
    CALCULATOR STACK FUNCTIONS
  * **************************************************************************/
 
-// Calculator stack starts at the start of memory after the program
+// Calculator stack starts at the start of memory after the program (and line index)
 // and grows towards the end
-// contains either floats or null-terminated strings with the length on the end
+// contains either floats, longs or null-terminated strings with the length on the end
 
 int stackPushNum(float val) {
-  if (sysSTACKEND + sizeof(float) > sysVARSTART)
+  if (sysSTACKEND + (int)sizeof(float) > sysVARSTART)
     return 0;	// out of memory
   uint8_t *p = &mem[sysSTACKEND];
   *(float *)p = val;
@@ -285,6 +506,24 @@ float stackPopNum() {
   uint8_t *p = &mem[sysSTACKEND];
   return *(float *)p;
 }
+int stackPushInt(long val) {
+  if (sysSTACKEND + (int)sizeof(long) > sysVARSTART)
+    return 0;	// out of memory
+  uint8_t *p = &mem[sysSTACKEND];
+  *(long *)p = val;
+  sysSTACKEND += sizeof(long);
+  return 1;
+}
+long stackPopInt() {
+  sysSTACKEND -= sizeof(long);
+  uint8_t *p = &mem[sysSTACKEND];
+  return *(long *)p;
+}
+// turn the integer depth numbers below the top of the stack into a float
+void stackIntToNum(int depth) {
+  uint8_t *p = &mem[sysSTACKEND] - (depth + 1) * sizeof(long);
+  *(float *)p = (float)*(long *)p;
+}
 int stackPushStr(char *str) {
   int len = 1 + strlen(str);
   if (sysSTACKEND + len + 2 > sysVARSTART)
@@ -381,7 +620,7 @@ void stackMidStr(int start, int len) {
 // Simple variable
 // table +--------+-------+-----------------+-----------------+ . . .
 //  <--- | len    | type  | name            | value           |
-// grows | 2bytes | 1byte | null terminated | float/string    |
+// grows | 2bytes | 1byte | null terminated | float/long/str  |
 //       +--------+-------+-----------------+-----------------+ . . .
 //
 // Array
@@ -392,47 +631,136 @@ void stackMidStr(int start, int len) {
 
 // variable type byte
 #define VAR_TYPE_NUM		    0x1
-#define VAR_TYPE_FORNEXT	  0x2
 #define VAR_TYPE_NUM_ARRAY	0x4
 #define VAR_TYPE_STRING		  0x8
 #define VAR_TYPE_STR_ARRAY	0x10
+#define VAR_TYPE_INT		    0x20
+// a simple number of either kind
+#define VAR_TYPE_ANY_NUM    (VAR_TYPE_NUM | VAR_TYPE_INT)
+
+// Variable slots
+// Each name a program uses gets a slot the first time it is looked up, and
+// keeps it until the variables are cleared. A name is known by its key: its
+// offset in the name table, or the letter of a one letter name, and whether
+// it is an array. The slot holds where the variable is, so a lookup through
+// a slot neither compares names nor walks the table (the compiled code
+// refers to variables by slot). Names with no key, or more names than
+// slots, are looked up by walking the table.
+// Anything that moves variables must keep the slots pointing at them.
+#define VAR_SLOTS         32
+#define VAR_NO_SLOT       0xFF
+#define VAR_SLOT_EMPTY    0xFFFF	// the variable doesn't exist (yet)
+#define VAR_KEY_TABLE     0x100	// the key is a name table offset, not a letter
+#define VAR_KEY_ARRAY     0x200
+static uint16_t varSlotKey[VAR_SLOTS];	// 0 for a slot not given out
+static uint16_t varSlot[VAR_SLOTS];	// offset of the variable in mem
+
+// forget the slots, which must go with any compiled code
+void clearVarSlots() {
+  memset(varSlotKey, 0, sizeof(varSlotKey));
+}
+
+// variables from start up to (not including) end have moved by delta bytes
+void moveVarSlots(int start, int end, int delta) {
+  for (uint8_t i = 0; i < VAR_SLOTS; i++) {
+    if (varSlotKey[i] && varSlot[i] != VAR_SLOT_EMPTY && varSlot[i] >= start && varSlot[i] < end)
+      varSlot[i] += delta;
+  }
+}
+
+// the slot of the name with this key (0 for none), giving it one if needed
+uint8_t getVarSlot(uint16_t key, bool isArray) {
+  if (!key) return VAR_NO_SLOT;
+  if (isArray) key |= VAR_KEY_ARRAY;
+  uint8_t i = (key ^ (key >> 4) ^ (key >> 8)) & (VAR_SLOTS - 1);
+  for (uint8_t n = 0; n < VAR_SLOTS; n++) {
+    if (varSlotKey[i] == key)
+      return i;
+    if (varSlotKey[i] == 0) {
+      varSlotKey[i] = key;
+      varSlot[i] = VAR_SLOT_EMPTY;
+      return i;
+    }
+    i = (i + 1) & (VAR_SLOTS - 1);
+  }
+  return VAR_NO_SLOT;
+}
+
+// the variable was created at offset
+void setVarSlot(uint8_t slot, int offset) {
+  if (slot != VAR_NO_SLOT) varSlot[slot] = offset;
+}
 
-uint8_t *findVariable(char *searchName, int searchMask) {
+// find a variable, through its slot if it has one
+uint8_t *findVariable(char *searchName, int searchMask, uint8_t slot) {
+  if (slot != VAR_NO_SLOT && varSlot[slot] != VAR_SLOT_EMPTY)
+    return &mem[varSlot[slot]];
   uint8_t *p = &mem[sysVARSTART];
   while (p < &mem[sysVAREND]) {
     int type = *(p + 2);
     if (type & searchMask) {
       uint8_t *name = p + 3;
-      if (strcasecmp((char*)name, searchName) == 0)
+      if (strcasecmp((char*)name, searchName) == 0) {
+        setVarSlot(slot, p - &mem[0]);
         return p;
+      }
     }
     p += *(uint16_t *)p;
   }
   return NULL;
 }
 
+// the name of the variable a slot was given to
+void varSlotName(uint8_t slot, char *name) {
+  uint16_t key = varSlotKey[slot];
+  if (key & VAR_KEY_TABLE) {
+    uint8_t *p = &mem[NAME_TABLE_START + (key & 0xFF)];
+    while (*p < 0x80)
+      *name++ = *p++;
+    *name++ = *p - 0x80;
+  }
+  else
+    *name++ = key & 0xFF;
+  *name = 0;
+}
+
+// find a variable by its slot alone, as the compiled code does
+uint8_t *findSlotVariable(uint8_t slot, int searchMask) {
+  if (varSlot[slot] != VAR_SLOT_EMPTY)
+    return &mem[varSlot[slot]];
+  char name[MAX_IDENT_LEN + 1];
+  varSlotName(slot, name);
+  return findVariable(name, searchMask, slot);
+}
+
 void deleteVariableAt(uint8_t *pos) {
   int len = *(uint16_t *)pos;
+  int offset = pos - &mem[0];
+  for (uint8_t i = 0; i < VAR_SLOTS; i++) {
+    if (varSlotKey[i] && varSlot[i] == offset)
+      varSlot[i] = VAR_SLOT_EMPTY;
+  }
   if (pos == &mem[sysVARSTART]) {
     sysVARSTART += len;
     return;
   }
   memmove(&mem[sysVARSTART] + len, &mem[sysVARSTART], pos - &mem[sysVARSTART]);
+  moveVarSlots(sysVARSTART, offset, len);
   sysVARSTART += len;
 }
 
 // todo - consistently return errors rather than 1 or 0?
 
-int storeNumVariable(char *name, float val) {
+// store the float or long value of a simple numeric variable
+int storeNumVariableOfType(char *name, int type, void *val, uint8_t slot) {
   // these can be modified in place
   uint8_t nameLen = strlen(name);
-  uint8_t *p = findVariable(name, VAR_TYPE_NUM | VAR_TYPE_FORNEXT);
+  uint8_t *p = findVariable(name, VAR_TYPE_ANY_NUM, slot);
   if (p != NULL)
   { // replace the old value
-    // (could either be VAR_TYPE_NUM or VAR_TYPE_FORNEXT)
     p += 3;	// len + type;
     p += nameLen + 1;
-    *(float *)p = val;
+    memcpy(p, val, sizeof(float));
   }
   else
   { // allocate a new variable
@@ -444,58 +772,27 @@ int storeNumVariable(char *name, float val) {
       return 0;	// out of memory
     sysVARSTART -= bytesNeeded;
 
+    setVarSlot(slot, sysVARSTART);
     uint8_t *p = &mem[sysVARSTART];
     *(uint16_t *)p = bytesNeeded;
     p += 2;
-    *p++ = VAR_TYPE_NUM;
+    *p++ = type;
     strcpy((char*)p, name);
     p += nameLen + 1;
-    *(float *)p = val;
+    memcpy(p, val, sizeof(float));
   }
   return 1;
 }
 
-int storeForNextVariable(char *name, float start, float step, float end, uint16_t lineNum, uint16_t stmtNum) {
-  uint8_t nameLen = strlen(name);
-  int bytesNeeded = 3;	// len + flags
-  bytesNeeded += nameLen + 1;	// name
-  bytesNeeded += 3 * sizeof(float);	// vals
-  bytesNeeded += 2 * sizeof(uint16_t);
-
-  // unlike simple numeric variables, these are reallocated if they already exist
-  // since the existing value might be a simple variable or a for/next variable
-  uint8_t *p = findVariable(name, VAR_TYPE_NUM | VAR_TYPE_FORNEXT);
-  if (p != NULL) {
-    // check there will actually be room for the new value
-    uint16_t oldVarLen = *(uint16_t*)p;
-    if (sysVARSTART - (bytesNeeded - oldVarLen) < sysSTACKEND)
-      return 0;	// not enough memory
-    deleteVariableAt(p);
-  }
-
-  if (sysVARSTART - bytesNeeded < sysSTACKEND)
-    return 0;	// out of memory
-  sysVARSTART -= bytesNeeded;
+int storeNumVariable(char *name, float val, uint8_t slot) {
+  return storeNumVariableOfType(name, VAR_TYPE_NUM, &val, slot);
+}
 
-  p = &mem[sysVARSTART];
-  *(uint16_t *)p = bytesNeeded;
-  p += 2;
-  *p++ = VAR_TYPE_FORNEXT;
-  strcpy((char*)p, name);
-  p += nameLen + 1;
-  *(float *)p = start;
-  p += sizeof(float);
-  *(float *)p = step;
-  p += sizeof(float);
-  *(float *)p = end;
-  p += sizeof(float);
-  *(uint16_t *)p = lineNum;
-  p += sizeof(uint16_t);
-  *(uint16_t *)p = stmtNum;
-  return 1;
+int storeIntVariable(char *name, long val, uint8_t slot) {
+  return storeNumVariableOfType(name, VAR_TYPE_INT, &val, slot);
 }
 
-int storeStrVariable(char *name, char *val) {
+int storeStrVariable(char *name, char *val, uint8_t slot) {
   uint8_t nameLen = strlen(name);
   uint8_t valLen = strlen(val);
   int bytesNeeded = 3;	// len + type
@@ -503,7 +800,7 @@ int storeStrVariable(char *name, char *val) {
   bytesNeeded += valLen + 1;	// val
 
   // strings and arrays are re-allocated if they already exist
-  uint8_t *p = findVariable(name, VAR_TYPE_STRING);
+  uint8_t *p = findVariable(name, VAR_TYPE_STRING, slot);
   if (p != NULL) {
     // check there will actually be room for the new value
     uint16_t oldVarLen = *(uint16_t*)p;
@@ -515,6 +812,7 @@ int storeStrVariable(char *name, char *val) {
   if (sysVARSTART - bytesNeeded < sysSTACKEND)
     return 0;	// out of memory
   sysVARSTART -= bytesNeeded;
+  setVarSlot(slot, sysVARSTART);
 
   p = &mem[sysVARSTART];
   *(uint16_t *)p = bytesNeeded;
@@ -526,14 +824,13 @@ int storeStrVariable(char *name, char *val) {
   return 1;
 }
 
-int createArray(char *name, int isString) {
+int createArray(char *name, int isString, uint8_t slot) {
   // dimensions and number of dimensions on the calculator stack
   uint8_t nameLen = strlen(name);
   int bytesNeeded = 3;	// len + flags
   bytesNeeded += nameLen + 1;	// name
   bytesNeeded += 2;		// num dims
   int numElements = 1;
-  int i = 0;
   int numDims = (int)stackPopNum();
   // keep the current stack position, since we'll need to pop these values again
   int oldSTACKEND = sysSTACKEND;
@@ -543,7 +840,7 @@ int createArray(char *name, int isString) {
   }
   bytesNeeded += 2 * numDims + (isString ? 1 : sizeof(float)) * numElements;
   // strings and arrays are re-allocated if they already exist
-  uint8_t *p = findVariable(name, (isString ? VAR_TYPE_STR_ARRAY : VAR_TYPE_NUM_ARRAY));
+  uint8_t *p = findVariable(name, (isString ? VAR_TYPE_STR_ARRAY : VAR_TYPE_NUM_ARRAY), slot);
   if (p != NULL) {
     // check there will actually be room for the new value
     uint16_t oldVarLen = *(uint16_t*)p;
@@ -555,6 +852,7 @@ int createArray(char *name, int isString) {
   if (sysVARSTART - bytesNeeded < sysSTACKEND)
     return 0;	// out of memory
   sysVARSTART -= bytesNeeded;
+  setVarSlot(slot, sysVARSTART);
 
   p = &mem[sysVARSTART];
   *(uint16_t *)p = bytesNeeded;
@@ -597,9 +895,9 @@ int _getArrayElemOffset(uint8_t **p, int *pOffset) {
   return 0;
 }
 
-int setNumArrayElem(char *name, float val) {
+int setNumArrayElem(char *name, float val, uint8_t slot) {
   // each index and number of dimensions on the calculator stack
-  uint8_t *p = findVariable(name, VAR_TYPE_NUM_ARRAY);
+  uint8_t *p = findVariable(name, VAR_TYPE_NUM_ARRAY, slot);
   if (p == NULL)
     return ERROR_VARIABLE_NOT_FOUND;
   p += 3 + strlen(name) + 1;
@@ -613,7 +911,7 @@ int setNumArrayElem(char *name, float val) {
   return ERROR_NONE;
 }
 
-int setStrArrayElem(char *name) {
+int setStrArrayElem(char *name, uint8_t slot) {
   // string is top of the stack
   // each index and number of dimensions on the calculator stack
 
@@ -623,7 +921,7 @@ int setStrArrayElem(char *name) {
   char *newValPtr = stackPopStr();
   int newValLen = strlen(newValPtr);
 
-  uint8_t *p = findVariable(name, VAR_TYPE_STR_ARRAY);
+  uint8_t *p = findVariable(name, VAR_TYPE_STR_ARRAY, slot);
   uint8_t *p1 = p;	// so we can correct the length when done
   if (p == NULL)
     return ERROR_VARIABLE_NOT_FOUND;
@@ -648,20 +946,21 @@ int setStrArrayElem(char *name) {
   // correct the length of the variable
   *(uint16_t*)p1 += bytesNeeded;
   memmove(&mem[sysVARSTART - bytesNeeded], &mem[sysVARSTART], p - &mem[sysVARSTART]);
+  moveVarSlots(sysVARSTART, p - &mem[0], -bytesNeeded);
   // copy in the new value
   strcpy((char*)(p - bytesNeeded), newValPtr);
   sysVARSTART -= bytesNeeded;
   return ERROR_NONE;
 }
 
-float lookupNumArrayElem(char *name, int *error) {
+// the element of the numeric array at p (NULL if there isn't one)
+float numArrayElem(uint8_t *p, int *error) {
   // each index and number of dimensions on the calculator stack
-  uint8_t *p = findVariable(name, VAR_TYPE_NUM_ARRAY);
   if (p == NULL) {
     *error = ERROR_VARIABLE_NOT_FOUND;
     return 0.0f;
   }
-  p += 3 + strlen(name) + 1;
+  p += 3 + strlen((char*)p + 3) + 1;
 
   int offset;
   int ret = _getArrayElemOffset(&p, &offset);
@@ -673,9 +972,13 @@ float lookupNumArrayElem(char *name, int *error) {
   return *(float *)p;
 }
 
-char *lookupStrArrayElem(char *name, int *error) {
+float lookupNumArrayElem(char *name, int *error, uint8_t slot) {
+  return numArrayElem(findVariable(name, VAR_TYPE_NUM_ARRAY, slot), error);
+}
+
+char *lookupStrArrayElem(char *name, int *error, uint8_t slot) {
   // each index and number of dimensions on the calculator stack
-  uint8_t *p = findVariable(name, VAR_TYPE_STR_ARRAY);
+  uint8_t *p = findVariable(name, VAR_TYPE_STR_ARRAY, slot);
   if (p == NULL) {
     *error = ERROR_VARIABLE_NOT_FOUND;
     return NULL;
@@ -697,8 +1000,8 @@ char *lookupStrArrayElem(char *name, int *error) {
   return (char *)p;
 }
 
-float lookupNumVariable(char *name) {
-  uint8_t *p = findVariable(name, VAR_TYPE_NUM | VAR_TYPE_FORNEXT);
+float lookupNumVariable(char *name, uint8_t slot) {
+  uint8_t *p = findVariable(name, VAR_TYPE_ANY_NUM, slot);
   if (p == NULL) {
     return FLT_MAX;
   }
@@ -706,8 +1009,17 @@ float lookupNumVariable(char *name) {
   return *(float *)p;
 }
 
-char *lookupStrVariable(char *name) {
-  uint8_t *p = findVariable(name, VAR_TYPE_STRING);
+int lookupIntVariable(char *name, long *val, uint8_t slot) {
+  uint8_t *p = findVariable(name, VAR_TYPE_ANY_NUM, slot);
+  if (p == NULL)
+    return 0;
+  p += 3 + strlen(name) + 1;
+  *val = *(long *)p;
+  return 1;
+}
+
+char *lookupStrVariable(char *name, uint8_t slot) {
+  uint8_t *p = findVariable(name, VAR_TYPE_STRING, slot);
   if (p == NULL) {
     return NULL;
   }
@@ -715,63 +1027,117 @@ char *lookupStrVariable(char *name) {
   return (char *)p;
 }
 
-ForNextData lookupForNextVariable(char *name) {
-  ForNextData ret;
-  uint8_t *p = findVariable(name, VAR_TYPE_NUM | VAR_TYPE_FORNEXT);
-  if (p == NULL)
-    ret.val = FLT_MAX;
-  else if (*(p + 2) != VAR_TYPE_FORNEXT)
-    ret.step = FLT_MAX;
-  else {
-    p += 3 + strlen(name) + 1;
-    ret.val = *(float *)p;
-    p += sizeof(float);
-    ret.step = *(float *)p;
-    p += sizeof(float);
-    ret.end = *(float *)p;
-    p += sizeof(float);
-    ret.lineNumber = *(uint16_t *)p;
-    p += sizeof(uint16_t);
-    ret.stmtNumber = *(uint16_t *)p;
-  }
-  return ret;
-}
-
 /* **************************************************************************
-   GOSUB STACK
+   CONTROL STACK
  * **************************************************************************/
-// gosub stack (if used) is after the variables
-int gosubStackPush(int lineNumber, int stmtNumber) {
-  int bytesNeeded = 2 * sizeof(uint16_t);
-  if (sysVARSTART - bytesNeeded < sysSTACKEND)
+// GOSUB and FOR frames share a stack which grows down from the end of memory
+// (sysGOSUBEND) to sysGOSUBSTART. The variable table sits below it, ending at
+// sysVAREND, and the gap in between is room kept for more frames. Pushing and
+// popping frames leaves the variables alone - they are only moved down when
+// the stack gets deeper than it has been since RUN.
+// Each frame is
+// +-------+-------+--------------------------------------------------------+
+// | len   | type  | GOSUB: line num, stmt num, stmt offset, generation     |
+// | 1byte | 1byte | FOR: ForNextData, generation, name (null terminated)   |
+// +-------+-------+--------------------------------------------------------+
+#define CTRL_GOSUB      1
+#define CTRL_FOR        2	// step and end are floats
+#define CTRL_FOR_INT    3	// step and end are longs, for a % variable
+#define CTRL_GROW       32	// bytes of room made each time the stack runs out
+
+// push a frame with dataLen bytes of data, returning where the data goes
+uint8_t *ctrlStackPush(uint8_t type, int dataLen) {
+  int len = 2 + dataLen;
+  int needed = sysVAREND - (sysGOSUBSTART - len);
+  if (needed > 0) {
+    // move the variable table down to make room
+    int grow = (needed < CTRL_GROW) ? CTRL_GROW : needed;
+    if (sysVARSTART - grow < sysSTACKEND) grow = needed;
+    if (sysVARSTART - grow < sysSTACKEND)
+      return NULL;	// out of memory
+    memmove(&mem[sysVARSTART] - grow, &mem[sysVARSTART], sysVAREND - sysVARSTART);
+    moveVarSlots(sysVARSTART, sysVAREND, -grow);
+    sysVARSTART -= grow;
+    sysVAREND -= grow;
+  }
+  sysGOSUBSTART -= len;
+  uint8_t *p = &mem[sysGOSUBSTART];
+  *p++ = len;
+  *p++ = type;
+  return p;
+}
+
+void ctrlStackPop() {
+  sysGOSUBSTART += mem[sysGOSUBSTART];
+}
+
+int gosubStackPush(int lineNumber, int stmtNumber, uint16_t stmtOffset) {
+  uint16_t *p = (uint16_t*)ctrlStackPush(CTRL_GOSUB, 4 * sizeof(uint16_t));
+  if (p == NULL)
     return 0;	// out of memory
-  // shift the variable table
-  memmove(&mem[sysVARSTART] - bytesNeeded, &mem[sysVARSTART], sysVAREND - sysVARSTART);
-  sysVARSTART -= bytesNeeded;
-  sysVAREND -= bytesNeeded;
-  // push the return address
-  sysGOSUBSTART = sysVAREND;
-  uint16_t *p = (uint16_t*)&mem[sysGOSUBSTART];
   *p++ = (uint16_t)lineNumber;
-  *p = (uint16_t)stmtNumber;
+  *p++ = (uint16_t)stmtNumber;
+  *p++ = stmtOffset;
+  *p = progGeneration;
   return 1;
 }
 
-int gosubStackPop(int *lineNumber, int *stmtNumber) {
-  if (sysGOSUBSTART == sysGOSUBEND)
+// also drops any FOR loops left unfinished inside the subroutine
+int gosubStackPop(int *lineNumber, int *stmtNumber, uint16_t *stmtOffset) {
+  int frame = sysGOSUBSTART;
+  while (frame < sysGOSUBEND && mem[frame + 1] != CTRL_GOSUB)
+    frame += mem[frame];
+  if (frame == sysGOSUBEND)
     return 0;
-  uint16_t *p = (uint16_t*)&mem[sysGOSUBSTART];
+  uint16_t *p = (uint16_t*)&mem[frame + 2];
   *lineNumber = (int) * p++;
-  *stmtNumber = (int) * p;
-  int bytesFreed = 2 * sizeof(uint16_t);
-  // shift the variable table
-  memmove(&mem[sysVARSTART] + bytesFreed, &mem[sysVARSTART], sysVAREND - sysVARSTART);
-  sysVARSTART += bytesFreed;
-  sysVAREND += bytesFreed;
-  sysGOSUBSTART = sysVAREND;
+  *stmtNumber = (int) * p++;
+  *stmtOffset = (*(p + 1) == progGeneration) ? *p : 0;
+  sysGOSUBSTART = frame + mem[frame];
+  return 1;
+}
+
+// find the loop for the variable name, looking no further back than the last GOSUB
+uint8_t *findForFrame(char *name) {
+  int frame = sysGOSUBSTART;
+  while (frame < sysGOSUBEND && mem[frame + 1] != CTRL_GOSUB) {
+    char *frameName = (char*)&mem[frame + 2 + sizeof(ForNextData) + sizeof(uint16_t)];
+    if (strcasecmp(frameName, name) == 0)
+      return &mem[frame];
+    frame += mem[frame];
+  }
+  return NULL;
+}
+
+// step and end are longs rather than floats if isInt is set
+int forStackPush(char *name, ForNextData *data, bool isInt) {
+  // starting a loop again drops the old one, and any loops inside it
+  uint8_t *frame = findForFrame(name);
+  if (frame)
+    sysGOSUBSTART = frame + *frame - &mem[0];
+  uint8_t *p = ctrlStackPush(isInt ? CTRL_FOR_INT : CTRL_FOR, sizeof(ForNextData) + sizeof(uint16_t) + strlen(name) + 1);
+  if (p == NULL)
+    return 0;	// out of memory
+  memcpy(p, data, sizeof(ForNextData));
+  p += sizeof(ForNextData);
+  *(uint16_t *)p = progGeneration;
+  strcpy((char*)p + sizeof(uint16_t), name);
   return 1;
 }
 
+// the loop is left at the top of the stack (any loops inside it are dropped)
+int lookupForFrame(char *name, ForNextData *ret) {
+  uint8_t *frame = findForFrame(name);
+  if (frame == NULL)
+    return ERROR_NEXT_WITHOUT_FOR;
+  sysGOSUBSTART = frame - &mem[0];
+  memcpy(ret, frame + 2, sizeof(ForNextData));
+  // the offset is only usable if nothing changed since the FOR
+  if (*(uint16_t *)(frame + 2 + sizeof(ForNextData)) != progGeneration)
+    ret->stmtOffset = 0;
+  return ERROR_NONE;
+}
+
 /* **************************************************************************
    LEXER
  * **************************************************************************/
@@ -779,6 +1145,8 @@ int gosubStackPop(int *lineNumber, int *stmtNumber) {
 static uint8_t *tokenIn, *tokenOut;
 static int tokenOutLeft;
 
+void foldConstants(uint8_t *tokens);
+
 // nextToken returns -1 for end of input, 0 for success, +ve number = error code
 int nextToken()
 {
@@ -833,14 +1201,17 @@ int nextToken()
     char identStr[MAX_IDENT_LEN + 1];
     int identLen = 0;
     identStr[identLen++] = *tokenIn++; // copy first char
-    while (isalnum(*tokenIn) || *tokenIn == '$') {
+    while (isalnum(*tokenIn) || *tokenIn == '$' || *tokenIn == '%') {
       if (identLen < MAX_IDENT_LEN)
         identStr[identLen++] = *tokenIn;
       tokenIn++;
     }
     identStr[identLen] = 0;
     // check to see if this is a keyword
-    for (int i = FIRST_IDENT_TOKEN; i <= LAST_IDENT_TOKEN; i++) {
+    int letter = toupper(identStr[0]) - 'A';
+    int lastKeyword = pgm_read_byte_near(&keywordStart[letter + 1]);
+    for (int k = pgm_read_byte_near(&keywordStart[letter]); k < lastKeyword; k++) {
+      int i = pgm_read_byte_near(&keywordTokens[k]);
       if (strcasecmp(identStr, (char *)pgm_read_word(&tokenTable[i].token)) == 0) {
         if (tokenOutLeft <= 1) return ERROR_LEXER_TOO_LONG;
         tokenOutLeft--;
@@ -861,8 +1232,8 @@ int nextToken()
       }
     }
     // no matching keyword - this must be an identifier
-    // $ is only allowed at the end
-    char *dollarPos = strchr(identStr, '$');
+    // $ or % is only allowed at the end
+    char *dollarPos = strpbrk(identStr, "$%");
     if  (dollarPos && dollarPos != &identStr[0] + identLen - 1) return ERROR_LEXER_UNEXPECTED_INPUT;
     if (tokenOutLeft <= 1 + identLen) return ERROR_LEXER_TOO_LONG;
     tokenOutLeft -= 1 + identLen;
@@ -894,18 +1265,64 @@ int nextToken()
     return 0;
   }
   // handle non-alpha tokens e.g. =
-  for (int i = LAST_NON_ALPHA_TOKEN; i >= FIRST_NON_ALPHA_TOKEN; i--) {
-    // do this "backwards" so we match >= correctly, not as > then =
-    int len = strlen((char *)pgm_read_word(&tokenTable[i].token));
-    if (strncmp((char *)pgm_read_word(&tokenTable[i].token), (char*)tokenIn, len) == 0) {
-      if (tokenOutLeft <= 1) return ERROR_LEXER_TOO_LONG;
-      *tokenOut++ = i;
-      tokenOutLeft--;
-      tokenIn += len;
-      return 0;
+  int op, len = 1;
+  switch (*tokenIn) {
+    case '(': op = TOKEN_LBRACKET; break;
+    case ')': op = TOKEN_RBRACKET; break;
+    case '+': op = TOKEN_PLUS; break;
+    case '-': op = TOKEN_MINUS; break;
+    case '*': op = TOKEN_MULT; break;
+    case '/': op = TOKEN_DIV; break;
+    case '=': op = TOKEN_EQUALS; break;
+    case ':': op = TOKEN_CMD_SEP; break;
+    case ';': op = TOKEN_SEMICOLON; break;
+    case ',': op = TOKEN_COMMA; break;
+    case '>':
+      // match >= as one token, not as > then =
+      if (tokenIn[1] == '=') { op = TOKEN_GT_EQ; len = 2; }
+      else op = TOKEN_GT;
+      break;
+    case '<':
+      if (tokenIn[1] == '>') { op = TOKEN_NOT_EQ; len = 2; }
+      else if (tokenIn[1] == '=') { op = TOKEN_LT_EQ; len = 2; }
+      else op = TOKEN_LT;
+      break;
+    default:
+      return ERROR_LEXER_UNEXPECTED_INPUT;
+  }
+  if (tokenOutLeft <= 1) return ERROR_LEXER_TOO_LONG;
+  *tokenOut++ = op;
+  tokenOutLeft--;
+  tokenIn += len;
+  return 0;
+}
+
+// store the whole numbers that fit in 1 or 2 bytes in the shorter forms
+void compactNumbers(uint8_t *tokens) {
+  uint8_t *in = tokens, *out = tokens;
+  while (1) {
+    uint8_t tok = *in;
+    int len = tokenLength(in);
+    long val = (tok == TOKEN_INTEGER) ? *(long*)(in + 1) : -1;
+    if (val >= 0 && val <= 255) {
+      *out++ = TOKEN_BYTE;
+      *out++ = (uint8_t)val;
+    }
+    else if (val > 255 && val <= 65535) {
+      *out++ = TOKEN_WORD;
+      *(uint16_t*)out = (uint16_t)val;
+      out += sizeof(uint16_t);
     }
+    else {
+      memmove(out, in, len);
+      out += len;
+    }
+    in += len;
+    if (tok == TOKEN_EOL)
+      break;
   }
-  return ERROR_LEXER_UNEXPECTED_INPUT;
+  tokenOutLeft += tokenOut - out;
+  tokenOut = out;
 }
 
 int tokenize(uint8_t *input, uint8_t *output, int outputSize)
@@ -918,7 +1335,10 @@ int tokenize(uint8_t *input, uint8_t *output, int outputSize)
     ret = nextToken();
     if (ret) break;
   }
-  return (ret > 0) ? ret : 0;
+  if (ret > 0) return ret;
+  foldConstants(output);
+  compactNumbers(output);
+  return 0;
 }
 
 /* **************************************************************************
@@ -930,13 +1350,17 @@ uint16_t lineNumber, stmtNumber;
 // stmt number is 0 for the first statement, then increases after each command seperator (:)
 // Note that IF a=1 THEN PRINT "x": print "y" is considered to be only 2 statements
 static uint16_t jumpLineNumber, jumpStmtNumber;
+// offset of the jump target statement within its line, 0 if it has to be found by stmt number
+static uint16_t jumpStmtOffset;
+static int targetStmtNumber, resumeStmtNumber;
 static uint16_t stopLineNumber, stopStmtNumber;
 static char breakCurrentLine;
 
-static uint8_t *tokenBuffer, *prevToken;
+static uint8_t *tokenBuffer, *prevToken, *lineStart, *stmtStart;
 static int curToken;
 static char identVal[MAX_IDENT_LEN + 1];
-static char isStrIdent;
+static char isStrIdent, isIntIdent;
+static uint16_t identKey;	// key of identVal for its variable slot, 0 if it has none
 static float numVal;
 static char *strVal;
 static long numIntVal;
@@ -945,23 +1369,43 @@ int getNextToken()
 {
   prevToken = tokenBuffer;
   curToken = *tokenBuffer++;
-  if (curToken == TOKEN_IDENT) {
+  if (curToken == TOKEN_IDENT || curToken == TOKEN_NAME) {
+    uint8_t *name = tokenBuffer;
+    bool inTable = (curToken == TOKEN_NAME);
+    identKey = 0;
+    if (inTable) {
+      // the parser sees a name from the name table as an ordinary identifier
+      identKey = VAR_KEY_TABLE | *tokenBuffer;
+      name = &mem[NAME_TABLE_START + *tokenBuffer++];
+      curToken = TOKEN_IDENT;
+    }
     int i = 0;
-    while (*tokenBuffer < 0x80)
-      identVal[i++] = *tokenBuffer++;
-    identVal[i] = (*tokenBuffer++) - 0x80;
-    isStrIdent = (identVal[i++] == '$');
+    while (*name < 0x80)
+      identVal[i++] = *name++;
+    identVal[i] = (*name++) - 0x80;
+    isStrIdent = (identVal[i] == '$');
+    isIntIdent = (identVal[i++] == '%');
     identVal[i++] = '\0';
+    if (i == 2)
+      identKey = identVal[0] | 0x20;	// one letter, either case
+    if (!inTable)
+      tokenBuffer = name;
   }
   else if (curToken == TOKEN_NUMBER) {
     numVal = *(float*)tokenBuffer;
     tokenBuffer += sizeof(float);
   }
   else if (curToken == TOKEN_INTEGER) {
-    // these are really just for line numbers
-    numVal = (float)(*(long*)tokenBuffer);
+    // line numbers and whole number constants
+    numIntVal = *(long*)tokenBuffer;
     tokenBuffer += sizeof(long);
   }
+  else if (curToken == TOKEN_BYTE || curToken == TOKEN_WORD) {
+    // small whole numbers are stored in fewer bytes
+    numIntVal = (curToken == TOKEN_BYTE) ? *tokenBuffer : *(uint16_t*)tokenBuffer;
+    tokenBuffer += (curToken == TOKEN_BYTE) ? 1 : sizeof(uint16_t);
+    curToken = TOKEN_INTEGER;
+  }
   else if (curToken == TOKEN_STRING) {
     strVal = (char*)tokenBuffer;
     tokenBuffer += 1 + strlen(strVal);
@@ -969,24 +1413,141 @@ int getNextToken()
   return curToken;
 }
 
+// offset of the statement after the current one, once it has been parsed
+uint16_t nextStmtOffset() {
+  // the current token is the : or end of line which ended the statement
+  return (curToken == TOKEN_CMD_SEP ? tokenBuffer : prevToken) - lineStart;
+}
+
 // value (int) returned from parseXXXXX
 #define ERROR_MASK						0x0FFF
 #define TYPE_MASK						  0xF000
 #define TYPE_NUMBER						0x0000
 #define TYPE_STRING						0x1000
+#define TYPE_INTEGER					0x2000	// a long on the stack rather than a float
 
-#define IS_TYPE_NUM(x) ((x & TYPE_MASK) == TYPE_NUMBER)
+#define IS_TYPE_NUM(x) ((x & TYPE_MASK) != TYPE_STRING)	// either kind of number
 #define IS_TYPE_STR(x) ((x & TYPE_MASK) == TYPE_STRING)
+#define IS_TYPE_INT(x) ((x & TYPE_MASK) == TYPE_INTEGER)
 
 // forward declarations
 int parseExpression();
+int parseExpr(bool keepInt);
+int intOp(int op, long *v);
 int parsePrimary();
 int expectNumber();
 
+// ops are the token values (numbers and variable slots follow inline) plus these
+#define OP_END            TOKEN_EOL
+#define OP_ARRAY          0x80	// array element, slot follows
+#define OP_NEG            0x81	// unary minus
+#define OP_STORE          0x82	// assign to a variable, slot follows
+#define OP_INTOP          0x83	// integer version of the op that follows
+#define OP_ITOF           0x84	// integer to float
+#define OP_ITOF2          0x85	// integer to float, for the number under the top one
+#define OP_FTOI           0x86	// float to integer
+#define OP_SKIP           0x87	// AND/OR short cut, flags and offset follow
+// OP_SKIP flags
+#define SKIP_OR           0x1	// skip if 1 (AND skips if 0)
+#define SKIP_LEFT_INT     0x2	// the left hand number is an integer
+#define SKIP_FLOAT_RESULT 0x4	// AND/OR would give a float
+
+#if COMPILE_EXPR
+// While compiling, the syntax check also writes each numeric expression out
+// as postfix code (see EXPRESSION COMPILER below)
+static uint8_t *codeOut, *codeLimit;	// codeOut is NULL when not compiling
+static bool codeFail;	// the expression can't be compiled (e.g. uses strings)
+// set while compiling the value of a simple numeric assignment
+static uint8_t *assignStart;
+static char *assignIdent;
+static uint16_t assignKey;
+#define COMPILING (codeOut != NULL)
+
+void emitBytes(const void *src, int len) {
+  if (!codeOut) return;
+  if (codeOut + len > codeLimit) codeFail = true;
+  else {
+    memcpy(codeOut, src, len);
+    codeOut += len;
+  }
+}
+
+void emitOp(uint8_t op) {
+  emitBytes(&op, 1);
+}
+
+void emitFail() {
+  codeFail = true;
+}
+
+// a variable by its slot, the code can't refer to a name without one
+void emitVarRef(uint8_t op, uint16_t key, bool isArray) {
+  if (!codeOut) return;
+  uint8_t slot = getVarSlot(key, isArray);
+  if (slot == VAR_NO_SLOT) codeFail = true;
+  emitOp(op);
+  emitOp(slot);
+}
+
+// start an OP_SKIP over the code that follows, returning where it is
+uint8_t *emitSkip(uint8_t flags) {
+  uint8_t *skip = codeOut;
+  emitOp(OP_SKIP);
+  emitOp(flags);
+  emitOp(0);
+  return skip;
+}
+
+// the skip ends here, so fill in its offset
+void emitSkipTarget(uint8_t *skip, uint8_t flags) {
+  if (!codeOut || codeFail) return;
+  int offset = codeOut - (skip + 3);
+  if (offset > 0xFF) codeFail = true;
+  skip[1] = flags;
+  skip[2] = offset;
+}
+#else
+#define COMPILING 0
+#define emitBytes(src, len)
+#define emitOp(op)
+#define emitFail()
+#define emitVarRef(op, key, isArray)
+#define emitSkip(flags) NULL
+#define emitSkipTarget(skip, flags)
+#endif
+
+// convert a float to an integer, truncating it
+int floatToInt(float f, long *l) {
+  if (!(f >= -2147483648.0f && f < 2147483648.0f))
+    return ERROR_OVERFLOW;
+  *l = (long)f;
+  return 0;
+}
+
+// turn an integer result into a float
+int numResult(int val) {
+  if (!(val & ERROR_MASK) && IS_TYPE_INT(val)) {
+    if (executeMode) stackIntToNum(0);
+    emitOp(OP_ITOF);
+    return TYPE_NUMBER;
+  }
+  return val;
+}
+
 // parse a number
 int parseNumberExpr() {
+  if (curToken == TOKEN_INTEGER) {
+    if (executeMode && !stackPushInt(numIntVal))
+      return ERROR_OUT_OF_MEMORY;
+    emitOp(TOKEN_INTEGER);
+    emitBytes(&numIntVal, sizeof(long));
+    getNextToken(); // consume the number
+    return TYPE_INTEGER;
+  }
   if (executeMode && !stackPushNum(numVal))
     return ERROR_OUT_OF_MEMORY;
+  emitOp(TOKEN_NUMBER);
+  emitBytes(&numVal, sizeof(float));
   getNextToken(); // consume the number
   return TYPE_NUMBER;
 }
@@ -1011,6 +1572,77 @@ int parseSubscriptExpr() {
   getNextToken(); // eat )
   if (executeMode && !stackPushNum(numDims))
     return ERROR_OUT_OF_MEMORY;
+  float dims = numDims;
+  emitOp(TOKEN_NUMBER);
+  emitBytes(&dims, sizeof(float));
+  return 0;
+}
+
+// apply a numeric function to the number on the stack
+// apply a maths function to v, for functions that only depend on their argument
+int numMathFn(int op, float *v) {
+  switch (op) {
+    case TOKEN_INT:
+      *v = (float)floor(*v);
+      break;
+    case TOKEN_SIN:     // SIN(number)
+      *v = (float)sin(*v);
+      break;
+    case TOKEN_COS:     // COS(number)
+      *v = (float)cos(*v);
+      break;
+    case TOKEN_TAN:     // TAN(number)
+      *v = (float)tan(*v);
+      break;
+    case TOKEN_EXP:     // EXP(number)
+      *v = (float)exp(*v);
+      break;
+    case TOKEN_SQRT:    // SQRT(number)
+      *v = (float)sqrt(*v);
+      break;
+    case TOKEN_LOG:    // LOG(number)
+      *v = (float)log(*v);
+      break;
+    default:
+      return ERROR_UNEXPECTED_TOKEN;
+  }
+  return 0;
+}
+
+int numFnCall(int op) {
+  int tmp;
+  switch (op) {
+    case TOKEN_PINREAD:
+      tmp = (int)stackPopNum();
+      if (!stackPushNum(host_digitalRead(tmp))) return ERROR_OUT_OF_MEMORY;
+      break;
+    case TOKEN_ANALOGRD:
+      tmp = (int)stackPopNum();
+      if (!stackPushNum(host_analogRead(tmp))) return ERROR_OUT_OF_MEMORY;
+      break;
+#if SPRITES
+    case TOKEN_HIT:
+      {
+        int b = (int)stackPopNum();
+        tmp = (int)stackPopNum();
+        if (tmp < 0 || tmp >= SPRITES || b < 0 || b >= SPRITES) return ERROR_BAD_PARAMETER;
+        if (!stackPushNum(host_spriteHit(tmp, b))) return ERROR_OUT_OF_MEMORY;
+      }
+      break;
+#endif
+#if GRAPHICS
+    case TOKEN_POINT:
+      {
+        int y = (int)stackPopNum();
+        tmp = (int)stackPopNum();
+        if (!stackPushNum(host_point(tmp, y))) return ERROR_OUT_OF_MEMORY;
+      }
+      break;
+#endif
+    default:
+      // the number is replaced on the top of the stack
+      return numMathFn(op, (float *)&mem[sysSTACKEND] - 1);
+  }
   return 0;
 }
 
@@ -1042,13 +1674,13 @@ int parseFnCallExpr() {
       getNextToken();
     }
   }
+  // only functions of numbers returning a number can be compiled
+  if (fnSpec & (TKN_ARG_MASK | TKN_RET_TYPE_STR)) emitFail();
+  else emitOp(op);
   // now all the arguments will be on the stack (last first)
   if (executeMode) {
     int tmp;
     switch (op) {
-      case TOKEN_INT:
-        stackPushNum((float)floor(stackPopNum()));
-        break;
       case TOKEN_STR:
         {
           char buf[16];
@@ -1113,35 +1745,11 @@ int parseFnCallExpr() {
           stackMidStr(start, tmp);
         }
         break;
-      case TOKEN_PINREAD:
-        tmp = (int)stackPopNum();
-        if (!stackPushNum(host_digitalRead(tmp))) return ERROR_OUT_OF_MEMORY;
-        break;
-      case TOKEN_ANALOGRD:
-        tmp = (int)stackPopNum();
-        if (!stackPushNum(host_analogRead(tmp))) return ERROR_OUT_OF_MEMORY;
-        break;
-      case TOKEN_SIN:     // SIN(number)
-        stackPushNum((float)sin(stackPopNum()));
-        break;
-      case TOKEN_COS:     // COS(number)
-        stackPushNum((float)cos(stackPopNum()));
-        break;
-      case TOKEN_TAN:     // TAN(number)
-        stackPushNum((float)tan(stackPopNum()));
-        break;
-      case TOKEN_EXP:     // EXP(number)
-        stackPushNum((float)exp(stackPopNum()));
-        break;
-      case TOKEN_SQRT:    // SQRT(number)
-        stackPushNum((float)sqrt( stackPopNum()));
-        break;
-      case TOKEN_LOG:    // LOG(number)
-        stackPushNum((float)log( stackPopNum()));
-        break;
 
       default:
-        return ERROR_UNEXPECTED_TOKEN;
+        // the purely numeric functions
+        tmp = numFnCall(op);
+        if (tmp) return tmp;
     }
   }
   if (curToken != TOKEN_RBRACKET) return ERROR_EXPR_MISSING_BRACKET;
@@ -1152,24 +1760,29 @@ int parseFnCallExpr() {
 // parse an identifer e.g. a$ or a(5,3)
 int parseIdentifierExpr() {
   char ident[MAX_IDENT_LEN + 1];
-  if (executeMode)
+  if (executeMode || COMPILING)
     strcpy(ident, identVal);
   int isStringIdentifier = isStrIdent;
+  int isIntIdentifier = isIntIdent;
+  uint16_t key = identKey;
+  int type = isStringIdentifier ? TYPE_STRING : TYPE_NUMBER;
+  if (isStringIdentifier) emitFail();
   getNextToken();	// eat ident
   if (curToken == TOKEN_LBRACKET) {
     // array access
     int val = parseSubscriptExpr();
     if (val) return val;
+    emitVarRef(OP_ARRAY, key, true);
     if (executeMode) {
       if (isStringIdentifier) {
         int error = 0;
-        char *str = lookupStrArrayElem(ident, &error);
+        char *str = lookupStrArrayElem(ident, &error, getVarSlot(key, true));
         if (error) return error;
         else if (!stackPushStr(str)) return ERROR_OUT_OF_MEMORY;
       }
       else {
         int error = 0;
-        float f = lookupNumArrayElem(ident, &error);
+        float f = lookupNumArrayElem(ident, &error, getVarSlot(key, true));
         if (error) return error;
         else if (!stackPushNum(f)) return ERROR_OUT_OF_MEMORY;
       }
@@ -1177,26 +1790,35 @@ int parseIdentifierExpr() {
   }
   else {
     // simple variable
+    emitVarRef(TOKEN_IDENT, key, false);
+    if (isIntIdentifier) type = TYPE_INTEGER;
     if (executeMode) {
+      uint8_t slot = getVarSlot(key, false);
       if (isStringIdentifier) {
-        char *str = lookupStrVariable(ident);
+        char *str = lookupStrVariable(ident, slot);
         if (!str) return ERROR_VARIABLE_NOT_FOUND;
         else if (!stackPushStr(str)) return ERROR_OUT_OF_MEMORY;
       }
+      else if (isIntIdentifier) {
+        long l;
+        if (!lookupIntVariable(ident, &l, slot)) return ERROR_VARIABLE_NOT_FOUND;
+        else if (!stackPushInt(l)) return ERROR_OUT_OF_MEMORY;
+      }
       else {
-        float f = lookupNumVariable(ident);
+        float f = lookupNumVariable(ident, slot);
         if (f == FLT_MAX) return ERROR_VARIABLE_NOT_FOUND;
         else if (!stackPushNum(f)) return ERROR_OUT_OF_MEMORY;
       }
     }
   }
-  return isStringIdentifier ? TYPE_STRING : TYPE_NUMBER;
+  return type;
 }
 
 // parse a string e.g. "hello"
 int parseStringExpr() {
   if (executeMode && !stackPushStr(strVal))
     return ERROR_OUT_OF_MEMORY;
+  emitFail();
   getNextToken(); // consume the string
   return TYPE_STRING;
 }
@@ -1204,7 +1826,7 @@ int parseStringExpr() {
 // parse a bracketed expressed e.g. (5+3)
 int parseParenExpr() {
   getNextToken();  // eat (
-  int val = parseExpression();
+  int val = parseExpr(true);
   if (val & ERROR_MASK) return val;
   if (curToken != TOKEN_RBRACKET)
     return ERROR_EXPR_MISSING_BRACKET;
@@ -1214,6 +1836,7 @@ int parseParenExpr() {
 
 int parse_RND() {
   getNextToken();
+  emitOp(TOKEN_RND);
   if (executeMode && !stackPushNum((float)rand() / (float)RAND_MAX))
     return ERROR_OUT_OF_MEMORY;
   return TYPE_NUMBER;
@@ -1221,6 +1844,7 @@ int parse_RND() {
 
 int parse_INKEY() {
   getNextToken();
+  emitFail();
   if (executeMode) {
     char str[2];
     str[0] = host_getKey();
@@ -1239,12 +1863,24 @@ int parseUnaryNumExp()
   if (val & ERROR_MASK) return val;
   if (!IS_TYPE_NUM(val))
     return ERROR_EXPR_EXPECTED_NUM;
+  if (IS_TYPE_INT(val)) {
+    op = (op == TOKEN_MINUS) ? OP_NEG : op;
+    emitOp(OP_INTOP);
+    emitOp(op);
+    if (executeMode && intOp(op, (long *)&mem[sysSTACKEND] - 1) == ERROR_OVERFLOW)
+      stackIntToNum(0);	// only -(-2147483648), which carries on as a float below
+    else
+      return TYPE_INTEGER;
+    op = TOKEN_MINUS;
+  }
   switch (op) {
     case TOKEN_MINUS:
       if (executeMode) stackPushNum(stackPopNum() * -1.0f);
+      emitOp(OP_NEG);
       return TYPE_NUMBER;
     case TOKEN_NOT:
       if (executeMode) stackPushNum(stackPopNum() ? 0.0f : 1.0f);
+      emitOp(TOKEN_NOT);
       return TYPE_NUMBER;
     default:
       return ERROR_UNEXPECTED_TOKEN;
@@ -1285,6 +1921,8 @@ int parsePrimary() {
     case TOKEN_MID:
     case TOKEN_PINREAD:
     case TOKEN_ANALOGRD:
+    case TOKEN_POINT:
+    case TOKEN_HIT:
     case TOKEN_SIN:
     case TOKEN_COS:
     case TOKEN_TAN:
@@ -1298,15 +1936,94 @@ int parsePrimary() {
   }
 }
 
-int getTokPrecedence() {
-  if (curToken == TOKEN_AND || curToken == TOKEN_OR) return 5;
-  if (curToken == TOKEN_EQUALS || curToken == TOKEN_NOT_EQ) return 10;
-  if (curToken == TOKEN_LT || curToken == TOKEN_GT || curToken == TOKEN_LT_EQ || curToken == TOKEN_GT_EQ) return 20;
-  if (curToken == TOKEN_MINUS || curToken == TOKEN_PLUS) return 30;
-  else if (curToken == TOKEN_MULT || curToken == TOKEN_DIV || curToken == TOKEN_MOD) return 40;
+int tokPrecedence(int tok) {
+  if (tok == TOKEN_AND || tok == TOKEN_OR) return 5;
+  if (tok == TOKEN_EQUALS || tok == TOKEN_NOT_EQ) return 10;
+  if (tok == TOKEN_LT || tok == TOKEN_GT || tok == TOKEN_LT_EQ || tok == TOKEN_GT_EQ) return 20;
+  if (tok == TOKEN_MINUS || tok == TOKEN_PLUS) return 30;
+  else if (tok == TOKEN_MULT || tok == TOKEN_DIV || tok == TOKEN_MOD) return 40;
   else return -1;
 }
 
+int getTokPrecedence() {
+  return tokPrecedence(curToken);
+}
+
+// apply an operator to the integers at v (v[0] op v[1], or just op v[0] for
+// OP_NEG and TOKEN_NOT), leaving the result in v[0]
+// returns ERROR_OVERFLOW, leaving v alone, if the result needs a float
+int intOp(int op, long *v) {
+  long l = v[0], res;
+  if (op == OP_NEG) {
+    if (l == LONG_MIN) return ERROR_OVERFLOW;
+    v[0] = -l;
+    return 0;
+  }
+  if (op == TOKEN_NOT) {
+    v[0] = l ? 0 : 1;
+    return 0;
+  }
+  long r = v[1];
+  switch (op) {
+    case TOKEN_PLUS:
+      if (__builtin_add_overflow(l, r, &res)) return ERROR_OVERFLOW;
+      v[0] = res;
+      break;
+    case TOKEN_MINUS:
+      if (__builtin_sub_overflow(l, r, &res)) return ERROR_OVERFLOW;
+      v[0] = res;
+      break;
+    case TOKEN_MULT:
+      if (__builtin_mul_overflow(l, r, &res)) return ERROR_OVERFLOW;
+      v[0] = res;
+      break;
+    case TOKEN_MOD:
+      if (r) v[0] = (r == -1) ? 0 : l % r;
+      else return ERROR_EXPR_DIV_ZERO;
+      break;
+    case TOKEN_LT: v[0] = l < r; break;
+    case TOKEN_GT: v[0] = l > r; break;
+    case TOKEN_EQUALS: v[0] = l == r; break;
+    case TOKEN_NOT_EQ: v[0] = l != r; break;
+    case TOKEN_LT_EQ: v[0] = l <= r; break;
+    case TOKEN_GT_EQ: v[0] = l >= r; break;
+    case TOKEN_AND: v[0] = r ? l : 0; break;
+    case TOKEN_OR: v[0] = r ? 1 : l; break;
+    default:
+      return ERROR_UNEXPECTED_TOKEN;
+  }
+  return 0;
+}
+
+// apply a binary operator to the two numbers at v, leaving the result in v[0]
+int numBinOp(int op, float *v) {
+  float l = v[0], r = v[1];
+  switch (op) {
+    case TOKEN_PLUS: v[0] = l + r; break;
+    case TOKEN_MINUS: v[0] = l - r; break;
+    case TOKEN_MULT: v[0] = l * r; break;
+    case TOKEN_DIV:
+      if (r) v[0] = l / r;
+      else return ERROR_EXPR_DIV_ZERO;
+      break;
+    case TOKEN_MOD:
+      if ((int)r) v[0] = (float)((int)l % (int)r);
+      else return ERROR_EXPR_DIV_ZERO;
+      break;
+    case TOKEN_LT: v[0] = l < r ? 1.0f : 0.0f; break;
+    case TOKEN_GT: v[0] = l > r ? 1.0f : 0.0f; break;
+    case TOKEN_EQUALS: v[0] = l == r ? 1.0f : 0.0f; break;
+    case TOKEN_NOT_EQ: v[0] = l != r ? 1.0f : 0.0f; break;
+    case TOKEN_LT_EQ: v[0] = l <= r ? 1.0f : 0.0f; break;
+    case TOKEN_GT_EQ: v[0] = l >= r ? 1.0f : 0.0f; break;
+    case TOKEN_AND: v[0] = r != 0.0f ? l : 0.0f; break;
+    case TOKEN_OR: v[0] = r != 0.0f ? 1 : l; break;
+    default:
+      return ERROR_UNEXPECTED_TOKEN;
+  }
+  return 0;
+}
+
 // Operator-Precedence Parsing
 int parseBinOpRHS(int ExprPrec, int lhsVal) {
   // If this is a binop, find its precedence.
@@ -1322,75 +2039,67 @@ int parseBinOpRHS(int ExprPrec, int lhsVal) {
     int BinOp = curToken;
     getNextToken();  // eat binop
 
+    // x AND y is 0 if x is 0, and x OR y is 1 if x is 1, so in those cases
+    // the right hand side is only syntax checked
+    bool skipRHS = false;
+    uint8_t *skip = NULL;
+    uint8_t skipFlags = 0;
+    if ((BinOp == TOKEN_AND || BinOp == TOKEN_OR) && IS_TYPE_NUM(lhsVal)) {
+      if (BinOp == TOKEN_OR) skipFlags |= SKIP_OR;
+      if (IS_TYPE_INT(lhsVal)) skipFlags |= SKIP_LEFT_INT;
+      skip = emitSkip(skipFlags);
+      if (executeMode) {
+        float l = IS_TYPE_INT(lhsVal) ? (float) * ((long *)&mem[sysSTACKEND] - 1) : *((float *)&mem[sysSTACKEND] - 1);
+        skipRHS = (BinOp == TOKEN_OR) ? (l == 1.0f) : (l == 0.0f);
+        if (skipRHS) executeMode = false;
+      }
+    }
+
     // Parse the primary expression after the binary operator.
     int rhsVal = parsePrimary();
-    if (rhsVal & ERROR_MASK) return rhsVal;
 
     // If BinOp binds less tightly with RHS than the operator after RHS, let
     // the pending operator take RHS as its LHS.
-    int NextPrec = getTokPrecedence();
-    if (TokPrec < NextPrec) {
+    if (!(rhsVal & ERROR_MASK) && TokPrec < getTokPrecedence())
       rhsVal = parseBinOpRHS(TokPrec + 1, rhsVal);
-      if (rhsVal & ERROR_MASK) return rhsVal;
-    }
+    if (skipRHS) executeMode = true;
+    if (rhsVal & ERROR_MASK) return rhsVal;
 
     if (IS_TYPE_NUM(lhsVal) && IS_TYPE_NUM(rhsVal))
     { // Number operations
-      float r, l;
-      if (executeMode) {
-        r = stackPopNum();
-        l = stackPopNum();
-      }
-      if (BinOp == TOKEN_PLUS) {
-        if (executeMode) stackPushNum(l + r);
-      }
-      else if (BinOp == TOKEN_MINUS) {
-        if (executeMode) stackPushNum(l - r);
-      }
-      else if (BinOp == TOKEN_MULT) {
-        if (executeMode) stackPushNum(l * r);
+      // two integers give an integer, apart from / (or if it overflows)
+      bool intResult = IS_TYPE_INT(lhsVal) && IS_TYPE_INT(rhsVal) && BinOp != TOKEN_DIV;
+      if (intResult)
+        emitOp(OP_INTOP);
+      else {
+        if (IS_TYPE_INT(lhsVal)) emitOp(OP_ITOF2);
+        if (IS_TYPE_INT(rhsVal)) emitOp(OP_ITOF);
       }
-      else if (BinOp == TOKEN_DIV) {
-        if (executeMode) {
-          if (r) stackPushNum(l / r);
-          else return ERROR_EXPR_DIV_ZERO;
-        }
+      emitOp(BinOp);
+      if (skip) emitSkipTarget(skip, skipFlags | (intResult ? 0 : SKIP_FLOAT_RESULT));
+      if (skipRHS) {
+        // the left hand number is the result
+        if (IS_TYPE_INT(lhsVal) && !intResult) stackIntToNum(0);
       }
-      else if (BinOp == TOKEN_MOD) {
-        if (executeMode) {
-          if ((int)r) stackPushNum((float)((int)l % (int)r));
-          else return ERROR_EXPR_DIV_ZERO;
+      else if (executeMode) {
+        // the result replaces the left hand number on the stack
+        int ret = ERROR_OVERFLOW;
+        if (intResult)
+          ret = intOp(BinOp, (long *)&mem[sysSTACKEND] - 2);
+        if (ret == ERROR_OVERFLOW) {
+          if (IS_TYPE_INT(lhsVal)) stackIntToNum(1);
+          if (IS_TYPE_INT(rhsVal)) stackIntToNum(0);
+          intResult = false;
+          ret = numBinOp(BinOp, (float *)&mem[sysSTACKEND] - 2);
         }
+        if (ret) return ret;
+        sysSTACKEND -= sizeof(float);
       }
-      else if (BinOp == TOKEN_LT) {
-        if (executeMode) stackPushNum(l < r ? 1.0f : 0.0f);
-      }
-      else if (BinOp == TOKEN_GT) {
-        if (executeMode) stackPushNum(l > r ? 1.0f : 0.0f);
-      }
-      else if (BinOp == TOKEN_EQUALS) {
-        if (executeMode) stackPushNum(l == r ? 1.0f : 0.0f);
-      }
-      else if (BinOp == TOKEN_NOT_EQ) {
-        if (executeMode) stackPushNum(l != r ? 1.0f : 0.0f);
-      }
-      else if (BinOp == TOKEN_LT_EQ) {
-        if (executeMode) stackPushNum(l <= r ? 1.0f : 0.0f);
-      }
-      else if (BinOp == TOKEN_GT_EQ) {
-        if (executeMode) stackPushNum(l >= r ? 1.0f : 0.0f);
-      }
-      else if (BinOp == TOKEN_AND) {
-        if (executeMode) stackPushNum(r != 0.0f ? l : 0.0f);
-      }
-      else if (BinOp == TOKEN_OR) {
-        if (executeMode) stackPushNum(r != 0.0f ? 1 : l);
-      }
-      else
-        return ERROR_UNEXPECTED_TOKEN;
+      lhsVal = intResult ? TYPE_INTEGER : TYPE_NUMBER;
     }
     else if (IS_TYPE_STR(lhsVal) && IS_TYPE_STR(rhsVal))
     { // String operations
+      emitFail();
       if (BinOp == TOKEN_PLUS) {
         if (executeMode)
           stackAdd2Strs();
@@ -1418,12 +2127,58 @@ int parseBinOpRHS(int ExprPrec, int lhsVal) {
   }
 }
 
-int parseExpression() {
+#if COMPILE_EXPR
+static uint8_t exprDepth;	// 0 = a whole expression rather than part of one
+int lookupCompiledExpr(uint16_t exprStart, uint16_t *exprEnd);
+int runCompiledExpr(uint8_t *pc);
+int compileExpr(bool keepInt);
+// set on the end offset of compiled code which leaves an integer
+#define COMPILED_INT_RESULT   0x8000
+#endif
+
+int parseExprTokens() {
   int val = parsePrimary();
   if (val & ERROR_MASK) return val;
   return parseBinOpRHS(0, val);
 }
 
+// an integer result is turned into a float unless keepInt is set
+int parseExpr(bool keepInt) {
+#if COMPILE_EXPR
+  if (exprDepth == 0) {
+    if (COMPILING)
+      return compileExpr(keepInt);
+    if (executeMode && compiledCount && lineNumber) {
+      // run the compiled version instead, then carry on after the expression
+      uint16_t exprEnd;
+      int code = lookupCompiledExpr(prevToken - &mem[0], &exprEnd);
+      if (code) {
+        int stackEnd = sysSTACKEND;
+        int val = runCompiledExpr(&mem[code]);
+        if (val != ERROR_OVERFLOW) {
+          if (val) return val;
+          tokenBuffer = &mem[exprEnd & ~COMPILED_INT_RESULT];
+          getNextToken();
+          return (exprEnd & COMPILED_INT_RESULT) ? TYPE_INTEGER : TYPE_NUMBER;
+        }
+        // an integer overflowed, which only the interpreter can carry on from
+        sysSTACKEND = stackEnd;
+      }
+    }
+  }
+  exprDepth++;
+  int val = parseExprTokens();
+  exprDepth--;
+#else
+  int val = parseExprTokens();
+#endif
+  return keepInt ? val : numResult(val);
+}
+
+int parseExpression() {
+  return parseExpr(false);
+}
+
 int expectNumber() {
   int val = parseExpression();
   if (val & ERROR_MASK) return val;
@@ -1432,6 +2187,361 @@ int expectNumber() {
   return 0;
 }
 
+/* **************************************************************************
+   CONSTANT FOLDING
+ * **************************************************************************/
+// Once a line is tokenized, constant sums like 2*3.14159 or SQRT(2) are worked
+// out and replaced by a single number (so LIST shows the result instead).
+// Only numbers next to each other are folded, and only where the surrounding
+// operators mean they would be evaluated together, e.g. a-2+3 is left alone.
+// The result has the type the interpreter would give it (see intOp), and
+// anything that would give an error, like 1/0, is left to go wrong at run time.
+
+bool isNumberToken(uint8_t tok) {
+  return tok == TOKEN_NUMBER || tok == TOKEN_INTEGER;
+}
+
+// true if the token can be the end of a value, so a - after it is a subtraction
+bool endsOperand(uint8_t tok) {
+  return isNumberToken(tok) || tok == TOKEN_IDENT || tok == TOKEN_STRING ||
+         tok == TOKEN_RBRACKET || tok == TOKEN_RND || tok == TOKEN_INKEY;
+}
+
+// a number token's value is either a long or a float
+typedef union {
+  long l;
+  float f;
+} FoldVal;
+
+float foldFloat(uint8_t *p) {
+  return (*p == TOKEN_INTEGER) ? (float)*(long*)(p + 1) : *(float*)(p + 1);
+}
+
+void removeTokens(uint8_t *start, uint8_t *end) {
+  memmove(start, end, tokenOut - end);
+  tokenOut -= end - start;
+  tokenOutLeft += end - start;
+}
+
+// replace the tokens from start up to end with a single number
+bool replaceWithNumber(uint8_t *start, uint8_t *end, bool isInt, FoldVal val) {
+  if (!isInt && !isfinite(val.f)) return false;
+  *start = isInt ? TOKEN_INTEGER : TOKEN_NUMBER;
+  memcpy(start + 1, &val, sizeof(val));
+  removeTokens(start + 1 + sizeof(val), end);
+  return true;
+}
+
+// try folding the constants starting at p (prev is the token before it, if any)
+bool foldAt(uint8_t *prev, uint8_t *p) {
+  uint8_t prevTok = prev ? *prev : TOKEN_EOL;
+  uint8_t *next = p + tokenLength(p);
+  FoldVal v[2];
+  if ((*p == TOKEN_MINUS || *p == TOKEN_NOT) && !endsOperand(prevTok) && isNumberToken(*next)) {
+    // unary operators only apply to the number straight after them
+    int op = (*p == TOKEN_MINUS) ? OP_NEG : TOKEN_NOT;
+    memcpy(v, next + 1, sizeof(v[0]));
+    if (*next == TOKEN_INTEGER && intOp(op, &v[0].l) == 0)
+      return replaceWithNumber(p, next + tokenLength(next), true, v[0]);
+    v[0].f = foldFloat(next);
+    v[0].f = (op == OP_NEG) ? -v[0].f : (v[0].f ? 0.0f : 1.0f);
+    return replaceWithNumber(p, next + tokenLength(next), false, v[0]);
+  }
+  if (*p == TOKEN_LBRACKET && isNumberToken(*next)) {
+    uint8_t *close = next + tokenLength(next);
+    if (*close != TOKEN_RBRACKET || prevTok == TOKEN_IDENT) return false;
+    if (pgm_read_byte_near(&tokenTable[prevTok].format) & TKN_ARGS_NUM_MASK) {
+      // a function call, which can be worked out if it only uses its argument
+      v[0].f = foldFloat(next);
+      if (numMathFn(prevTok, &v[0].f)) return false;
+      return replaceWithNumber(prev, close + 1, false, v[0]);
+    }
+    // (number) is just the number
+    removeTokens(close, close + 1);
+    removeTokens(p, next);
+    return true;
+  }
+  if (isNumberToken(*p)) {
+    int prec = tokPrecedence(*next);
+    uint8_t *rhs = next + 1;
+    if (prec < 0 || !isNumberToken(*rhs)) return false;
+    uint8_t *after = rhs + tokenLength(rhs);
+    // the operators either side must not take the numbers first
+    if (prevTok == TOKEN_NOT || tokPrecedence(prevTok) >= prec || tokPrecedence(*after) > prec)
+      return false;
+    int op = *next;
+    int ret = ERROR_OVERFLOW;
+    if (*p == TOKEN_INTEGER && *rhs == TOKEN_INTEGER && op != TOKEN_DIV) {
+      memcpy(&v[0], p + 1, sizeof(v[0]));
+      memcpy(&v[1], rhs + 1, sizeof(v[1]));
+      ret = intOp(op, &v[0].l);
+      if (ret == 0) return replaceWithNumber(p, after, true, v[0]);
+    }
+    if (ret != ERROR_OVERFLOW) return false;
+    v[0].f = foldFloat(p);
+    v[1].f = foldFloat(rhs);
+    if (numBinOp(op, &v[0].f)) return false;
+    return replaceWithNumber(p, after, false, v[0]);
+  }
+  return false;
+}
+
+void foldConstants(uint8_t *tokens) {
+  bool folded;
+  do {
+    folded = false;
+    uint8_t *p = tokens, *prev = NULL;
+    // leave a line number alone
+    if (*p == TOKEN_INTEGER) {
+      prev = p;
+      p += tokenLength(p);
+    }
+    while (*p != TOKEN_EOL && !folded) {
+      folded = foldAt(prev, p);
+      prev = p;
+      p += tokenLength(p);
+    }
+  } while (folded);
+}
+
+/* **************************************************************************
+   EXPRESSION COMPILER
+ * **************************************************************************/
+#if COMPILE_EXPR
+// On the first jump after RUN (or after the program is edited) every numeric
+// expression in the program is compiled to postfix code, which is run instead
+// of parsing the tokens again. It is stored after the line index:
+// +--------+--------+-----+--------+   +--------+--------+ . . .
+// | start  |  end   | ops | OP_END |...| block  | block  |  directory of blocks,
+// | 2bytes | 2bytes |     |        |   | 2bytes | 2bytes |  last compiled first
+// +--------+--------+-----+--------+   +--------+--------+ . . .
+// start/end are the offsets in mem of the expression's tokens. A simple numeric
+// assignment is compiled as a whole and its block starts at the variable name.
+// Variables are referred to by their slot alone (see VARIABLE TABLE FUNCTIONS).
+// If the code uses up memory needed at run time it is dropped (see processInput).
+static uint16_t compiledDir;	// offset of the directory in mem
+
+int parseStmts();
+
+// compile the whole expression at the current token
+int compileExpr(bool keepInt) {
+  uint8_t *block = codeOut;
+  uint16_t exprStart = prevToken - &mem[0];
+  // an assignment is compiled as a whole, starting at the variable name
+  char *storeIdent = assignIdent;
+  if (storeIdent) exprStart = assignStart - &mem[0];
+  assignIdent = NULL;
+  codeFail = false;
+  codeOut += 2 * sizeof(uint16_t);
+  exprDepth++;
+  int val = parseExprTokens();
+  exprDepth--;
+  // a lone number or variable is just as quick to interpret
+  uint8_t *operand = block + 2 * sizeof(uint16_t);
+  if (*operand == TOKEN_NUMBER) operand += 1 + sizeof(float);
+  else if (*operand == TOKEN_INTEGER) operand += 1 + sizeof(long);
+  else if (*operand == TOKEN_IDENT) operand += 2;
+  bool worthwhile = codeOut > operand || storeIdent;
+  if (!(val & ERROR_MASK) && IS_TYPE_NUM(val)) {
+    if (storeIdent) {
+      // match the value to the variable
+      bool intVar = storeIdent[strlen(storeIdent) - 1] == '%';
+      if (intVar && !IS_TYPE_INT(val)) emitOp(OP_FTOI);
+      if (!intVar && IS_TYPE_INT(val)) emitOp(OP_ITOF);
+      emitVarRef(OP_STORE, assignKey, false);
+    }
+    else if (!keepInt)
+      val = numResult(val);
+  }
+  emitOp(OP_END);
+  // the directory grows down from codeLimit
+  if ((val & ERROR_MASK) || !IS_TYPE_NUM(val) || codeFail || !worthwhile || codeOut + sizeof(uint16_t) > codeLimit) {
+    codeOut = block;
+    return val;
+  }
+  *(uint16_t*)block = exprStart;
+  *(uint16_t*)(block + 2) = (prevToken - &mem[0]) | (IS_TYPE_INT(val) && !storeIdent ? COMPILED_INT_RESULT : 0);
+  codeLimit -= sizeof(uint16_t);
+  *(uint16_t*)codeLimit = block - &mem[0];
+  compiledCount++;
+  return val;
+}
+
+void compileProgram() {
+  uint16_t codeStart = sysPROGEND + progIndexLen;
+  if (codeOut || codeStart >= sysVARSTART) return;
+  // use at most a quarter of the free memory
+  codeOut = &mem[codeStart];
+  codeLimit = codeOut + (sysVARSTART - codeStart) / 4;
+  // parsing the lines would lose any pending jump
+  uint16_t saveLine = jumpLineNumber, saveStmt = jumpStmtNumber, saveOffset = jumpStmtOffset;
+  int saveTarget = targetStmtNumber;
+  targetStmtNumber = 0;
+  executeMode = false;
+  compiledCount = 0;
+  for (uint8_t *p = &mem[nameTableLen()]; p < &mem[sysPROGEND]; p += *(uint16_t *)p) {
+    tokenBuffer = p + 4;
+    getNextToken();
+    parseStmts();
+  }
+  executeMode = true;
+  jumpLineNumber = saveLine;
+  jumpStmtNumber = saveStmt;
+  jumpStmtOffset = saveOffset;
+  targetStmtNumber = saveTarget;
+  // move the directory down to just after the code
+  compiledDir = codeOut - &mem[0];
+  memmove(codeOut, codeLimit, compiledCount * sizeof(uint16_t));
+  progIndexLen = compiledDir + compiledCount * sizeof(uint16_t) - sysPROGEND;
+  sysSTACKSTART = sysSTACKEND = sysPROGEND + progIndexLen;
+  codeOut = NULL;
+}
+
+// give the memory used by the compiled code back to the calculator stack
+void dropCompiledCode() {
+  compiledCount = 0;
+  progIndexLen = lineIndexCount * sizeof(uint16_t);
+}
+
+// find the compiled code for the expression starting at exprStart
+int lookupCompiledExpr(uint16_t exprStart, uint16_t *exprEnd) {
+  uint16_t *dir = (uint16_t *)&mem[compiledDir];
+  int lo = 0, hi = compiledCount - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    uint16_t *block = (uint16_t *)&mem[dir[mid]];
+    if (block[0] == exprStart) {
+      *exprEnd = block[1];
+      return dir[mid] + 2 * sizeof(uint16_t);
+    }
+    // the directory was filled downwards, so it is in descending order
+    if (block[0] > exprStart) lo = mid + 1;
+    else hi = mid - 1;
+  }
+  return 0;
+}
+
+// the value of the simple variable in a slot, NULL if there isn't one
+float *compiledVarLocation(uint8_t slot) {
+  uint8_t *p = findSlotVariable(slot, VAR_TYPE_ANY_NUM);
+  if (p == NULL) return NULL;
+  // the value is the last thing in the entry
+  return (float *)(p + *(uint16_t *)p - sizeof(float));
+}
+
+// run compiled code, leaving the result (if any) on the calculator stack
+int runCompiledExpr(uint8_t *pc) {
+  // the top of the stack is kept in sp, and only written back for calls
+  // which use the stack themselves
+  float *sp = (float *)&mem[sysSTACKEND];
+  uint8_t *stackLimit = &mem[sysVARSTART] - sizeof(float);
+  int ret;
+  while (1) {
+    uint8_t op = *pc++;
+    switch (op) {
+      case OP_END:
+        sysSTACKEND = (uint8_t *)sp - &mem[0];
+        return 0;
+      case TOKEN_NUMBER:
+        if ((uint8_t *)sp > stackLimit) return ERROR_OUT_OF_MEMORY;
+        *sp++ = *(float*)pc;
+        pc += sizeof(float);
+        break;
+      case TOKEN_INTEGER:
+        if ((uint8_t *)sp > stackLimit) return ERROR_OUT_OF_MEMORY;
+        memcpy(sp++, pc, sizeof(long));
+        pc += sizeof(long);
+        break;
+      case TOKEN_IDENT:
+        {
+          // float or long, the code already knows which
+          float *var = compiledVarLocation(*pc++);
+          if (var == NULL) return ERROR_VARIABLE_NOT_FOUND;
+          if ((uint8_t *)sp > stackLimit) return ERROR_OUT_OF_MEMORY;
+          memcpy(sp++, var, sizeof(float));
+        }
+        break;
+      case OP_STORE:
+        {
+          uint8_t slot = *pc++;
+          float *var = compiledVarLocation(slot);
+          sp--;
+          if (var) memcpy(var, sp, sizeof(float));
+          else {
+            // first assignment, so the variable has to be created
+            char name[MAX_IDENT_LEN + 1];
+            varSlotName(slot, name);
+            sysSTACKEND = (uint8_t *)sp - &mem[0];
+            if (name[strlen(name) - 1] == '%') ret = storeIntVariable(name, *(long *)sp, slot);
+            else ret = storeNumVariable(name, *sp, slot);
+            if (!ret) return ERROR_OUT_OF_MEMORY;
+          }
+        }
+        break;
+      case OP_INTOP:
+        op = *pc++;
+        if (op != OP_NEG && op != TOKEN_NOT) sp--;
+        ret = intOp(op, (long *)sp - 1);
+        if (ret) return ret;
+        break;
+      case OP_ITOF:
+        sp[-1] = (float)((long *)sp)[-1];
+        break;
+      case OP_ITOF2:
+        sp[-2] = (float)((long *)sp)[-2];
+        break;
+      case OP_SKIP:
+        {
+          uint8_t flags = *pc++;
+          uint8_t offset = *pc++;
+          float l = (flags & SKIP_LEFT_INT) ? (float)*((long *)sp - 1) : sp[-1];
+          if ((flags & SKIP_OR) ? l == 1.0f : l == 0.0f) {
+            // the left hand number is the result
+            if ((flags & SKIP_LEFT_INT) && (flags & SKIP_FLOAT_RESULT)) sp[-1] = l;
+            pc += offset;
+          }
+        }
+        break;
+      case OP_FTOI:
+        ret = floatToInt(sp[-1], (long *)sp - 1);
+        if (ret) return ret;
+        break;
+      case OP_ARRAY:
+        {
+          int error = 0;
+          sysSTACKEND = (uint8_t *)sp - &mem[0];
+          float f = numArrayElem(findSlotVariable(*pc++, VAR_TYPE_NUM_ARRAY), &error);
+          if (error) return error;
+          if (!stackPushNum(f)) return ERROR_OUT_OF_MEMORY;
+          sp = (float *)&mem[sysSTACKEND];
+        }
+        break;
+      case TOKEN_RND:
+        if ((uint8_t *)sp > stackLimit) return ERROR_OUT_OF_MEMORY;
+        *sp++ = (float)rand() / (float)RAND_MAX;
+        break;
+      case OP_NEG:
+        sp[-1] = -sp[-1];
+        break;
+      case TOKEN_NOT:
+        sp[-1] = sp[-1] ? 0.0f : 1.0f;
+        break;
+      default:
+        if ((op >= TOKEN_PLUS && op <= TOKEN_LT_EQ) || op == TOKEN_MOD || op == TOKEN_AND || op == TOKEN_OR) {
+          sp--;
+          ret = numBinOp(op, sp - 1);
+        }
+        else {
+          sysSTACKEND = (uint8_t *)sp - &mem[0];
+          ret = numFnCall(op);
+          sp = (float *)&mem[sysSTACKEND];
+        }
+        if (ret) return ret;
+    }
+  }
+}
+#endif
+
 int parse_RUN() {
   getNextToken();
   uint16_t startLine = 1;
@@ -1447,6 +2557,9 @@ int parse_RUN() {
   if (executeMode) {
     // clear variables
     sysVARSTART = sysVAREND = sysGOSUBSTART = sysGOSUBEND = MEMORY_SIZE;
+    clearVarSlots();
+    // rebuild the line index (and compiled code) now the variables are gone
+    invalidateLineIndex();
     jumpLineNumber = startLine;
     stopLineNumber = stopStmtNumber = 0;
   }
@@ -1479,6 +2592,19 @@ int parse_PAUSE() {
   return 0;
 }
 
+int parse_REFRESH() {
+  getNextToken();
+  int val = expectNumber();
+  if (val) return val;	// error
+  if (executeMode) {
+    float hz = stackPopNum();
+    if (hz < 0 || hz > 65535)
+      return ERROR_BAD_PARAMETER;
+    host_setRefresh((uint16_t)hz);
+  }
+  return 0;
+}
+
 int parse_LIST() {
   getNextToken();
   uint16_t first = 0, last = 0;
@@ -1561,14 +2687,118 @@ int parseTwoIntCmd() {
   return 0;
 }
 
+#if GRAPHICS
+// parse a graphics stmt, e.g. PLOT 10,5 or LINE 0,0,127,31
+int parseGraphicsCmd() {
+  int op = curToken;
+  int args = (op == TOKEN_LINE || op == TOKEN_RECT) ? 4 : 2;
+  int xy[4];
+  getNextToken();
+  for (int i = 0; i < args; i++) {
+    if (i) {
+      if (curToken != TOKEN_COMMA)
+        return ERROR_UNEXPECTED_TOKEN;
+      getNextToken();
+    }
+    int val = expectNumber();
+    if (val) return val;	// error
+  }
+  if (executeMode) {
+    for (int i = args - 1; i >= 0; i--)
+      xy[i] = (int)stackPopNum();
+    switch (op) {
+      case TOKEN_PLOT:
+        host_plot(xy[0], xy[1], 1);
+        break;
+      case TOKEN_UNPLOT:
+        host_plot(xy[0], xy[1], 0);
+        break;
+      case TOKEN_LINE:
+        host_line(xy[0], xy[1], xy[2], xy[3], 1);
+        break;
+      case TOKEN_RECT:
+        host_rect(xy[0], xy[1], xy[2], xy[3], 1);
+        break;
+    }
+  }
+  return 0;
+}
+#endif
+
+#if SPRITES
+// SPRITE n,"hex" defines sprite n, SPRITE n AT x,y shows it at a pixel position
+int parse_SPRITE() {
+  getNextToken();
+  int val = expectNumber();
+  if (val) return val;	// error
+  if (curToken == TOKEN_AT) {
+    getNextToken();
+    val = expectNumber();
+    if (val) return val;	// error
+    if (curToken != TOKEN_COMMA)
+      return ERROR_UNEXPECTED_TOKEN;
+    getNextToken();
+    val = expectNumber();
+    if (val) return val;	// error
+    if (executeMode) {
+      int y = (int)stackPopNum();
+      int x = (int)stackPopNum();
+      int n = (int)stackPopNum();
+      if (n < 0 || n >= SPRITES)
+        return ERROR_BAD_PARAMETER;
+      host_moveSprite(n, x, y);
+    }
+  }
+  else if (curToken == TOKEN_COMMA) {
+    getNextToken();
+    val = parseExpression();
+    if (val & ERROR_MASK) return val;
+    if (!IS_TYPE_STR(val))
+      return ERROR_EXPR_EXPECTED_STR;
+    if (executeMode) {
+      char *hex = stackPopStr();
+      int n = (int)stackPopNum();
+      if (n < 0 || n >= SPRITES)
+        return ERROR_BAD_PARAMETER;
+      host_defineSprite(n, hex);
+    }
+  }
+  else
+    return ERROR_UNEXPECTED_TOKEN;
+  return 0;
+}
+#endif
+
 // this handles both LET a$="hello" and INPUT a$ type assignments
 int parseAssignment(bool inputStmt) {
   char ident[MAX_IDENT_LEN + 1];
   int val;
   if (curToken != TOKEN_IDENT) return ERROR_UNEXPECTED_TOKEN;
-  if (executeMode)
+#if COMPILE_EXPR
+  if (!inputStmt && executeMode && compiledCount && lineNumber) {
+    // run the compiled version of the whole assignment if there is one
+    uint16_t stmtEnd;
+    int code = lookupCompiledExpr(prevToken - &mem[0], &stmtEnd);
+    if (code) {
+      int stackEnd = sysSTACKEND;
+      val = runCompiledExpr(&mem[code]);
+      if (val != ERROR_OVERFLOW) {
+        if (val) return val;
+        tokenBuffer = &mem[stmtEnd];
+        getNextToken();
+        return 0;
+      }
+      // an integer overflowed, so interpret it instead
+      sysSTACKEND = stackEnd;
+    }
+  }
+  uint8_t *identStart = prevToken;
+#endif
+  if (executeMode || COMPILING)
     strcpy(ident, identVal);
   int isStringIdentifier = isStrIdent;
+  int isIntIdentifier = isIntIdent;
+  uint16_t key = identKey;
   int isArray = 0;
   getNextToken();	// eat ident
   if (curToken == TOKEN_LBRACKET) {
@@ -1597,7 +2827,14 @@ int parseAssignment(bool inputStmt) {
     // from LET statement
     if (curToken != TOKEN_EQUALS) return ERROR_UNEXPECTED_TOKEN;
     getNextToken(); // eat =
-    val = parseExpression();
+#if COMPILE_EXPR
+    if (COMPILING && !isArray && !isStringIdentifier) {
+      assignStart = identStart;
+      assignIdent = ident;
+      assignKey = key;
+    }
+#endif
+    val = parseExpr(isIntIdentifier && !isArray);
     if (val & ERROR_MASK) return val;
   }
   // type checking and actual assignment
@@ -1606,11 +2843,20 @@ int parseAssignment(bool inputStmt) {
     if (!IS_TYPE_NUM(val)) return ERROR_EXPR_EXPECTED_NUM;
     if (executeMode) {
       if (isArray) {
-        val = setNumArrayElem(ident, stackPopNum());
+        val = setNumArrayElem(ident, stackPopNum(), getVarSlot(key, true));
         if (val) return val;
       }
+      else if (isIntIdentifier) {
+        long l;
+        if (IS_TYPE_INT(val)) l = stackPopInt();
+        else {
+          val = floatToInt(stackPopNum(), &l);
+          if (val) return val;
+        }
+        if (!storeIntVariable(ident, l, getVarSlot(key, false))) return ERROR_OUT_OF_MEMORY;
+      }
       else {
-        if (!storeNumVariable(ident, stackPopNum())) return ERROR_OUT_OF_MEMORY;
+        if (!storeNumVariable(ident, stackPopNum(), getVarSlot(key, false))) return ERROR_OUT_OF_MEMORY;
       }
     }
   }
@@ -1622,11 +2868,11 @@ int parseAssignment(bool inputStmt) {
         // annoyingly, we've got the string at the top of the stack
         // (from parseExpression) and the array index stuff (from
         // parseSubscriptExpr) underneath.
-        val = setStrArrayElem(ident);
+        val = setStrArrayElem(ident, getVarSlot(key, true));
         if (val) return val;
       }
       else {
-        if (!storeStrVariable(ident, stackGetStr())) return ERROR_OUT_OF_MEMORY;
+        if (!storeStrVariable(ident, stackGetStr(), getVarSlot(key, false))) return ERROR_OUT_OF_MEMORY;
         stackPopStr();
       }
     }
@@ -1649,39 +2895,66 @@ int parse_IF() {
   else return 0;
 }
 
+// parse a FOR start, end or step value, which is a long if isInt is set
+int expectForValue(bool isInt, float *f, long *l) {
+  int val = parseExpr(isInt);
+  if (val & ERROR_MASK) return val;
+  if (!IS_TYPE_NUM(val))
+    return ERROR_EXPR_EXPECTED_NUM;
+  if (!executeMode)
+    return 0;
+  if (!isInt)
+    *f = stackPopNum();
+  else if (IS_TYPE_INT(val))
+    *l = stackPopInt();
+  else
+    return floatToInt(stackPopNum(), l);
+  return 0;
+}
+
 int parse_FOR() {
   char ident[MAX_IDENT_LEN + 1];
-  float start, end, step = 1.0f;
+  ForNextData data;
+  float start;
+  long istart;
   getNextToken();	// eat for
   if (curToken != TOKEN_IDENT || isStrIdent) return ERROR_UNEXPECTED_TOKEN;
   if (executeMode)
     strcpy(ident, identVal);
+  uint16_t key = identKey;
+  // an integer variable counts with integers
+  bool isInt = isIntIdent;
+  if (isInt) data.istep = 1;
+  else data.step = 1.0f;
   getNextToken();	// eat ident
   if (curToken != TOKEN_EQUALS) return ERROR_UNEXPECTED_TOKEN;
   getNextToken(); // eat =
   // parse START
-  int val = expectNumber();
+  int val = expectForValue(isInt, &start, &istart);
   if (val) return val;	// error
-  if (executeMode)
-    start = stackPopNum();
   // parse TO
   if (curToken != TOKEN_TO) return ERROR_UNEXPECTED_TOKEN;
   getNextToken(); // eat TO
   // parse END
-  val = expectNumber();
+  val = expectForValue(isInt, &data.end, &data.iend);
   if (val) return val;	// error
-  if (executeMode)
-    end = stackPopNum();
   // parse optional STEP
   if (curToken == TOKEN_STEP) {
     getNextToken(); // eat STEP
-    val = expectNumber();
+    val = expectForValue(isInt, &data.step, &data.istep);
     if (val) return val;	// error
-    if (executeMode)
-      step = stackPopNum();
   }
   if (executeMode) {
-    if (!storeForNextVariable(ident, start, step, end, lineNumber, stmtNumber)) return ERROR_OUT_OF_MEMORY;
+    data.lineNumber = lineNumber;
+    data.stmtNumber = stmtNumber;
+    data.stmtOffset = nextStmtOffset();
+    // the loop goes on the stack first, so running out of memory leaves
+    // the variable as it was
+    if (!forStackPush(ident, &data, isInt)) return ERROR_OUT_OF_MEMORY;
+    uint8_t slot = getVarSlot(key, false);
+    if (isInt) val = storeIntVariable(ident, istart, slot);
+    else val = storeNumVariable(ident, start, slot);
+    if (!val) return ERROR_OUT_OF_MEMORY;
   }
   return 0;
 }
@@ -1690,17 +2963,37 @@ int parse_NEXT() {
   getNextToken();	// eat next
   if (curToken != TOKEN_IDENT || isStrIdent) return ERROR_UNEXPECTED_TOKEN;
   if (executeMode) {
-    ForNextData data = lookupForNextVariable(identVal);
-    if (data.val == FLT_MAX) return ERROR_VARIABLE_NOT_FOUND;
-    else if (data.step == FLT_MAX) return ERROR_NEXT_WITHOUT_FOR;
+    ForNextData data;
+    int ret = lookupForFrame(identVal, &data);
+    if (ret) return ret;
+    bool loop;
+    uint8_t slot = getVarSlot(identKey, false);
     // update and store the count variable
-    data.val += data.step;
-    storeNumVariable(identVal, data.val);
-    // loop?
-    if ((data.step >= 0 && data.val <= data.end) || (data.step < 0 && data.val >= data.end)) {
+    if (isIntIdent) {
+      long val, next;
+      if (!lookupIntVariable(identVal, &val, slot)) return ERROR_VARIABLE_NOT_FOUND;
+      // stop rather than wrap around
+      if (__builtin_add_overflow(val, data.istep, &next))
+        loop = false;
+      else {
+        storeIntVariable(identVal, next, slot);
+        loop = (data.istep >= 0 && next <= data.iend) || (data.istep < 0 && next >= data.iend);
+      }
+    }
+    else {
+      float val = lookupNumVariable(identVal, slot);
+      if (val == FLT_MAX) return ERROR_VARIABLE_NOT_FOUND;
+      val += data.step;
+      storeNumVariable(identVal, val, slot);
+      loop = (data.step >= 0 && val <= data.end) || (data.step < 0 && val >= data.end);
+    }
+    if (loop) {
       jumpLineNumber = data.lineNumber;
       jumpStmtNumber = data.stmtNumber + 1;
+      jumpStmtOffset = data.stmtOffset;
     }
+    else
+      ctrlStackPop();
   }
   getNextToken();	// eat ident
   return 0;
@@ -1715,7 +3008,7 @@ int parse_GOSUB() {
     if (startLine <= 0)
       return ERROR_BAD_LINE_NUM;
     jumpLineNumber = startLine;
-    if (!gosubStackPush(lineNumber, stmtNumber))
+    if (!gosubStackPush(lineNumber, stmtNumber, nextStmtOffset()))
       return ERROR_OUT_OF_MEMORY;
   }
   return 0;
@@ -1763,11 +3056,14 @@ int parseLoadSaveCmd() {
 #endif
     }
     else {
-      if (op == TOKEN_SAVE)
-        host_saveProgram(autoexec);
+      if (op == TOKEN_SAVE) {
+        if (!host_saveProgram(autoexec))
+          return ERROR_BAD_PARAMETER;
+      }
       else if (op == TOKEN_LOAD) {
         reset();
-        host_loadProgram();
+        if (!host_loadProgram())
+          return ERROR_BAD_PARAMETER;
       }
       else
         return ERROR_UNEXPECTED_CMD;
@@ -1798,7 +3094,7 @@ int parseSimpleCmd() {
       case TOKEN_RETURN:
         {
           int returnLineNumber, returnStmtNumber;
-          if (!gosubStackPop(&returnLineNumber, &returnStmtNumber))
+          if (!gosubStackPop(&returnLineNumber, &returnStmtNumber, &jumpStmtOffset))
             return ERROR_RETURN_WITHOUT_GOSUB;
           jumpLineNumber = returnLineNumber;
           jumpStmtNumber = returnStmtNumber + 1;
@@ -1813,6 +3109,14 @@ int parseSimpleCmd() {
         host_directoryExtEEPROM();
 #endif
         break;
+      case TOKEN_COMPACT:
+#if EXTERNAL_EEPROM
+        host_compactExtEEPROM();
+#endif
+        break;
+      case TOKEN_FLUSH:
+        host_flushSync();
+        break;
     }
   }
   return 0;
@@ -1821,14 +3125,16 @@ int parseSimpleCmd() {
 int parse_DIM() {
   char ident[MAX_IDENT_LEN + 1];
   getNextToken();	// eat DIM
-  if (curToken != TOKEN_IDENT) return ERROR_UNEXPECTED_TOKEN;
+  // there are no integer arrays
+  if (curToken != TOKEN_IDENT || isIntIdent) return ERROR_UNEXPECTED_TOKEN;
   if (executeMode)
     strcpy(ident, identVal);
   int isStringIdentifier = isStrIdent;
+  uint16_t key = identKey;
   getNextToken();	// eat ident
   int val = parseSubscriptExpr();
   if (val) return val;
-  if (executeMode && !createArray(ident, isStringIdentifier ? 1 : 0))
+  if (executeMode && !createArray(ident, isStringIdentifier ? 1 : 0, getVarSlot(key, true)))
     return ERROR_OUT_OF_MEMORY;
   return 0;
 }
@@ -1836,25 +3142,28 @@ int parse_DIM() {
 int parse_IMG() {
   getNextToken();
   int val = parseExpression();
+  if (val & ERROR_MASK) return val;
   if (!IS_TYPE_STR(val))
     return ERROR_EXPR_EXPECTED_STR;
-  host_Img(stackPopStr());
+  if (executeMode)
+    host_Img((uint8_t*)stackPopStr());
   return 0;
 }
 
-static int targetStmtNumber;
 int parseStmts()
 {
   int ret = 0;
   breakCurrentLine = 0;
   jumpLineNumber = 0;
   jumpStmtNumber = 0;
+  jumpStmtOffset = 0;
 
   while (ret == 0) {
     if (curToken == TOKEN_EOL)
       break;
-    if (executeMode)
-      sysSTACKEND = sysSTACKSTART = sysPROGEND;	// clear calculator stack
+    if (executeMode)	// clear calculator stack (it starts after the line index)
+      sysSTACKEND = sysSTACKSTART = sysPROGEND + progIndexLen;
+    stmtStart = prevToken;
     int needCmdSep = 1;
     switch (curToken) {
       case TOKEN_PRINT: ret = parse_PRINT(); break;
@@ -1871,7 +3180,11 @@ int parseStmts()
       case TOKEN_GOSUB: ret = parse_GOSUB(); break;
       case TOKEN_DIM: ret = parse_DIM(); break;
       case TOKEN_PAUSE: ret = parse_PAUSE(); break;
+      case TOKEN_REFRESH: ret = parse_REFRESH(); break;
       case TOKEN_IMG:ret = parse_IMG();break;
+#if SPRITES
+      case TOKEN_SPRITE: ret = parse_SPRITE(); break;
+#endif
 
       case TOKEN_LOAD:
       case TOKEN_SAVE:
@@ -1879,6 +3192,15 @@ int parseStmts()
         ret = parseLoadSaveCmd();
         break;
 
+#if GRAPHICS
+      case TOKEN_PLOT:
+      case TOKEN_UNPLOT:
+      case TOKEN_LINE:
+      case TOKEN_RECT:
+        ret = parseGraphicsCmd();
+        break;
+#endif
+
       case TOKEN_POSITION:
 #if GPIO
       case TOKEN_PIN:
@@ -1893,6 +3215,8 @@ int parseStmts()
       case TOKEN_RETURN:
       case TOKEN_CLS:
       case TOKEN_DIR:
+      case TOKEN_COMPACT:
+      case TOKEN_FLUSH:
         ret = parseSimpleCmd();
         break;
       default:
@@ -1922,8 +3246,29 @@ int parseStmts()
   return ret;
 }
 
+#if COMPILE_EXPR
+// statements which can be run again after running out of memory: they only
+// change variables or where the program goes, and check for room before
+// they change anything. Others (PRINT, SAVE ...) may already have done
+// something, or ran out of something other than RAM.
+bool canRetryStmt(uint8_t token) {
+  switch (token) {
+    case TOKEN_LET:
+    case TOKEN_IDENT:
+    case TOKEN_IF:
+    case TOKEN_FOR:
+    case TOKEN_NEXT:
+    case TOKEN_GOTO:
+    case TOKEN_GOSUB:
+    case TOKEN_DIM:
+      return true;
+  }
+  return false;
+}
+#endif
+
 int processInput(uint8_t *tokenBuf) {
-  // first token can be TOKEN_INTEGER for line number - stored as a float in numVal
+  // first token can be TOKEN_INTEGER for line number - stored in numIntVal
   // store as WORD line number (max 65535)
   tokenBuffer = tokenBuf;
   getNextToken();
@@ -1931,7 +3276,7 @@ int processInput(uint8_t *tokenBuf) {
   uint16_t gotLineNumber = 0;
   uint8_t *lineStartPtr = 0;
   if (curToken == TOKEN_INTEGER) {
-    long val = (long)numVal;
+    long val = numIntVal;
     if (val <= 65535) {
       gotLineNumber = (uint16_t)val;
       lineStartPtr = tokenBuffer;
@@ -1942,7 +3287,7 @@ int processInput(uint8_t *tokenBuf) {
   }
 
   executeMode = false;
-  targetStmtNumber = 0;
+  targetStmtNumber = resumeStmtNumber = 0;
   int ret = parseStmts();	// syntax check
   if (ret != ERROR_NONE)
     return ret;
@@ -1953,15 +3298,17 @@ int processInput(uint8_t *tokenBuf) {
   }
   else {
     // we start off executing from the input buffer
-    tokenBuffer = tokenBuf;
+    tokenBuffer = lineStart = tokenBuf;
+    progGeneration++;
     executeMode = true;
     lineNumber = 0;	// buffer
-    uint8_t *p;
+    uint8_t *p = NULL;
 
     while (1) {
       getNextToken();
 
-      stmtNumber = 0;
+      stmtNumber = resumeStmtNumber;
+      resumeStmtNumber = 0;
       // skip any statements? (e.g. for/next)
       if (targetStmtNumber) {
         executeMode = false;
@@ -1971,6 +3318,16 @@ int processInput(uint8_t *tokenBuf) {
       }
       // now execute
       ret = parseStmts();
+#if COMPILE_EXPR
+      if (ret == ERROR_OUT_OF_MEMORY && compiledCount && canRetryStmt(*stmtStart)) {
+        // the compiled code may be what used up the memory, so drop it
+        // and run the statement again
+        dropCompiledCode();
+        tokenBuffer = stmtStart;
+        resumeStmtNumber = stmtNumber;
+        continue;
+      }
+#endif
       if (ret != ERROR_NONE)
         break;
 
@@ -1984,12 +3341,18 @@ int processInput(uint8_t *tokenBuf) {
 
       if (!lineNumber && !jumpLineNumber && jumpStmtNumber) {
         // we're executing the buffer, and need to jump stmt (e.g. for/next)
-        tokenBuffer = tokenBuf;
+        tokenBuffer = lineStart = tokenBuf;
       }
       else {
         // we're executing the program
         if (jumpLineNumber || jumpStmtNumber) {
           // line/statement number was changed e.g. goto
+          if (!lineIndexTried) {
+            buildLineIndex();
+#if COMPILE_EXPR
+            compileProgram();
+#endif
+          }
           p = findProgLine(jumpLineNumber);
         }
         else {
@@ -2001,16 +3364,23 @@ int processInput(uint8_t *tokenBuf) {
           break;	// end of program
 
         lineNumber = *(uint16_t*)(p + 2);
-        tokenBuffer = p + 4;
+        tokenBuffer = lineStart = p + 4;
         // if the target for a jump is missing (e.g. line deleted) and we're on the next line
         // reset the stmt number to 0
         if (jumpLineNumber && jumpStmtNumber && lineNumber > jumpLineNumber)
           jumpStmtNumber = 0;
       }
-      if (jumpStmtNumber)
-        targetStmtNumber = jumpStmtNumber;
+      if (jumpStmtNumber) {
+        if (jumpStmtOffset) {
+          // go straight to the statement rather than parsing up to it
+          tokenBuffer += jumpStmtOffset;
+          resumeStmtNumber = jumpStmtNumber;
+        }
+        else
+          targetStmtNumber = jumpStmtNumber;
+      }
 
-      if (host_ESCPressed())
+      if (escTyped && host_ESCPressed())
       {
         ret = ERROR_BREAK_PRESSED;
         break;
@@ -2023,10 +3393,12 @@ int processInput(uint8_t *tokenBuf) {
 void reset() {
   // program at the start of memory
   sysPROGEND = 0;
+  programChanged();
   // stack is at the end of the program area
   sysSTACKSTART = sysSTACKEND = sysPROGEND;
   // variables/gosub stack at the end of memory
   sysVARSTART = sysVAREND = sysGOSUBSTART = sysGOSUBEND = MEMORY_SIZE;
+  clearVarSlots();
   memset(&mem[0], 0, MEMORY_SIZE);
 
   stopLineNumber = 0;
@@ -16,11 +16,17 @@
 //GPIO 1...USE GPIO   0...GPIO NONE
 #define GPIO						    0
 
+//COMPILE_EXPR 1...COMPILE NUMERIC EXPRESSIONS ON RUN   0...INTERPRET ONLY
+#define COMPILE_EXPR				1
+
 #define TOKEN_EOL           0
 #define TOKEN_IDENT					1	// special case - identifier follows
 #define TOKEN_INTEGER				2	// special case - integer follows (line numbers only)
 #define TOKEN_NUMBER				3	// special case - number follows
 #define TOKEN_STRING				4	// special case - string follows
+#define TOKEN_BYTE					5	// special case - integer 0-255 follows in 1 byte
+#define TOKEN_WORD					6	// special case - integer 256-65535 follows in 2 bytes
+#define TOKEN_NAME					7	// special case - offset of identifier in the name table follows
 
 #define TOKEN_LBRACKET			8
 #define TOKEN_RBRACKET			9
@@ -86,10 +92,21 @@
 #define TOKEN_EXP					  69
 #define TOKEN_SQRT					70
 #define TOKEN_LOG					  71
-#define TOKEN_IMG           72  // LAST_IDENT_TOKEN
+#define TOKEN_IMG           72
+#define TOKEN_REFRESH       73
+#define TOKEN_FLUSH         74
+#define TOKEN_PLOT          75
+#define TOKEN_UNPLOT        76
+#define TOKEN_LINE          77
+#define TOKEN_RECT          78
+#define TOKEN_POINT         79
+#define TOKEN_SPRITE        80
+#define TOKEN_AT            81
+#define TOKEN_HIT           82
+#define TOKEN_COMPACT       83  // LAST_IDENT_TOKEN
 
 #define FIRST_IDENT_TOKEN	  23
-#define LAST_IDENT_TOKEN	  72
+#define LAST_IDENT_TOKEN	  83
 
 #define FIRST_NON_ALPHA_TOKEN		            8
 #define LAST_NON_ALPHA_TOKEN		            22
@@ -121,6 +138,7 @@
 #define ERROR_STR_SUBSCRIPT_OUT_RANGE			 	22
 #define ERROR_IN_VAL_INPUT							    23
 #define ERROR_BAD_PARAMETER							    24
+#define ERROR_OVERFLOW							        25
 
 #define MAX_IDENT_LEN								        8
 #define MAX_NUMBER_LEN								      10
@@ -137,17 +155,18 @@ extern int sysGOSUBEND;
 
 extern uint16_t lineNumber;							    // 0 = input buffer
 
+// step and end are longs for an integer (%) variable
 typedef struct {
-  float val;
-  float step;
-  float end;
+  union { float step; long istep; };
+  union { float end; long iend; };
   uint16_t lineNumber;
   uint16_t stmtNumber;
+  uint16_t stmtOffset;	// 0 if the next statement has to be found by number
 }
 ForNextData;
 
 typedef struct {
-  char *token;
+  const char *token;
   uint8_t format;
 }
 TokenTableEntry;
@@ -14,11 +14,13 @@
 WS2812  LED(NUMPIXELS); 
 cRGB    cRGBvalue;
 
-uint8_t idle = 0;
-uint8_t _shift = 0, _fn = 0, _sym = 0;
-uint8_t KEY = 0, hadPressed = 0;
 uint8_t Mode = 0; //0->normal.1->shift 2->long_shift, 3->sym, 4->long_sym 5->fn,6->long_fn
 
+// keys typed, with the modifier mode they were pressed in already applied
+volatile byte keyBuf[KEYBUF_SIZE];
+volatile uint8_t keyHead = 0, keyTail = 0;
+volatile bool escTyped = false;   // an ESC is waiting in keyBuf
+
 void flashOn(byte r, byte g, byte b) {
   cRGBvalue.r = r;
   cRGBvalue.g = g;
@@ -54,143 +56,123 @@ void keybordSetup(void) {
   flashOn(0, 0, 0);
 }
 
-byte getInput(uint8_t delay_time) {
+// the key held down on the matrix (1-48), or 0
+byte scanMatrix() {
   byte ret = 0;
   byte i, j;
-  hadPressed = 1;
   for (i = 0; i < 4; i++) {
-    digitalWrite(A3, (0b00001110 >> i) & 0b00000001);
-    digitalWrite(A2, (0b00001101 >> i) & 0b00000001);
-    digitalWrite(A1, (0b00001011 >> i) & 0b00000001);
-    digitalWrite(A0, (0b00000111 >> i) & 0b00000001);
+    // drive one row (A3, A2, A1, A0) low
+    PORTC = (PORTC & 0xF0) | (0x0F & ~(0x08 >> i));
+    delayMicroseconds(3);
     for (j = 0; j < 8; j++) {
       ret++;
-      if (PIND == pgm_read_byte(&pinDmap[j])) {
-        flashOn(3, 3, 3);
-        delay(delay_time);
-        flashOn(0, 0, 0);
+      if (PIND == pgm_read_byte(&pinDmap[j]))
         return ret;
-      }
     }
     for (j = 0; j < 4; j++) {
       ret++;
-      if (PINB == pgm_read_byte(&pinBmap[j])) {
-        flashOn(3, 3, 3);
-        delay(delay_time);
-        flashOn(0, 0, 0);
+      if (PINB == pgm_read_byte(&pinBmap[j]))
         return ret;
-      }
     }
   }
-  hadPressed = 0;
   return 0;
 }
 
-byte getChar(uint8_t delay_time)
-{
-  byte c = 0;
-  if (shiftPressed) {
-    if (Mode > 0) {
-      _shift = 0;
-      Mode = 0;
-      delay(200);
-    } else {
-      if (_shift < LONGPRESSEDTIME)_shift++;
-      _sym = 0; _fn = 0; idle = 0;
-      return 0;
-    }
-  }
-  if ( _shift == LONGPRESSEDTIME) {
-    //long shift
-    Mode = 2;
-  } else if ( 0 < _shift) {
-    // shift
-    Mode = 1;
-  }
+void putKey(byte c) {
+  uint8_t next = (keyHead + 1) % KEYBUF_SIZE;
+  if (c == 0 || next == keyTail) return;	// nothing to add, or the buffer is full
+  keyBuf[keyHead] = c;
+  keyHead = next;
+  if (c == 0x1B) escTyped = true;
+}
 
-  if (symPressed) {
-    if (Mode > 0) {
-      _sym = 0;
-      Mode = 0;
-      delay(200);
-    } else {
-      if (_sym < LONGPRESSEDTIME)_sym++;
-      _shift = 0; _fn = 0; idle = 0;
-      return 0;
-    }
-  }
-  if ( _sym == LONGPRESSEDTIME) {
-    //long sym
-    Mode = 4;
-  } else if ( 0 < _sym) {
-    // sym
-    Mode = 3;
-  }
+// type key (1-48) in the current mode, a one-shot mode ends with it
+void typeKey(byte key) {
+  putKey(pgm_read_byte(&KeyMap[key - 1][Mode]));
+  if ((Mode == 1) || (Mode == 3) || (Mode == 5))
+    Mode = 0;
+}
+
+// Scan the keyboard, called every KEYSCAN_MS from the timer interrupt.
+// A change only counts once the keys have read the same for KEYDEBOUNCE_MS.
+// A held key types again after KEYDELAY_MS, then every KEYREPEAT_MS.
+// Shift, sym and fn are sticky: press and release one for the next key,
+// hold it for LONGPRESSEDTIME to lock it, and press any of them to cancel.
+void keyScan(void) {
+  static uint16_t now = 0, readSince = 0, modSince = 0, repeatAt = 0;
+  static byte readKey = 0, readMods = 0;  // as last scanned
+  static byte key = 0, mods = 0;          // debounced
+  static bool modCancel = false;
+  static byte led = 0xFF;
+  byte m, k, l;
 
-  if (fnPressed) {
-    if (Mode > 0) {
-      _fn = 0;
+  now++;
+  m = (shiftPressed ? 1 : 0) | (symPressed ? 2 : 0) | (fnPressed ? 4 : 0);
+  k = m ? 0 : scanMatrix();   // keys are ignored while a modifier is down
+  if (k != readKey || m != readMods) {
+    readKey = k;
+    readMods = m;
+    readSince = now;
+  }
+  else if ((uint16_t)(now - readSince) >= KEYDEBOUNCE_MS / KEYSCAN_MS) {
+    if (m && !mods) {
+      modCancel = Mode > 0;
       Mode = 0;
-      delay(200);
-    } else {
-      if (_fn < LONGPRESSEDTIME)_fn++;
-      _shift = 0; _sym = 0; idle = 0;
-      return 0;
+      modSince = now;
+    }
+    else if (!m && mods && !modCancel) {
+      if (mods & 1) Mode = 1;         // shift
+      else if (mods & 2) Mode = 3;    // sym
+      else Mode = 5;                  // fn
+      if ((uint16_t)(now - modSince) >= LONGPRESSEDTIME / KEYSCAN_MS) Mode++;  // long
+    }
+    mods = m;
+    if (k != key) {
+      key = k;
+      if (key) {
+        typeKey(key);
+        repeatAt = now + KEYDELAY_MS / KEYSCAN_MS;
+      }
     }
   }
-  if ( _fn == LONGPRESSEDTIME) {
-    //long fn
-    Mode = 6;
-  } else if ( 0 < _fn) {
-    // fn
-    Mode = 5;
+  if (key && (int16_t)(now - repeatAt) >= 0) {
+    typeKey(key);
+    repeatAt = now + KEYREPEAT_MS / KEYSCAN_MS;
   }
 
-  switch (Mode) {
-    case 0://normal
-      flashOn(0, 0, 0); break;
-    case 1://shift
-      if (idle < 4) {
-        flashOn(0, 0, 0);
-      } else {
-        flashOn(4, 0, 0);
-      }
-      break;
-    case 2://long_shift
-      flashOn(4, 0, 0); break;
-    case 3://sym
-      if (idle < 4) {
-        flashOn(0, 0, 0);
-      } else {
-        flashOn(0, 4, 0);
-      }
-      break;
-    case 4://long_sym
-      flashOn(0, 4, 0); break;
-    case 5://fn
-      if (idle < 4) {
-        flashOn(0, 0, 0);
-      } else {
-        flashOn(0, 0, 4);
-      }
-      break;
-    case 6://long_fn
-      flashOn(0, 0, 4); break;
+  // white while a key is down, otherwise the mode colour, blinking for one key
+  if (key) l = 7;
+  else if (Mode == 0 || ((Mode & 1) && (now & 0x40))) l = 0;
+  else l = 1 << ((Mode - 1) / 2);
+  if (l != led) {
+    byte v = (l == 7) ? 3 : 4;
+    led = l;
+    flashOn((l & 1) ? v : 0, (l & 2) ? v : 0, (l & 4) ? v : 0);
   }
+}
 
-  if (hadPressed == 0) {
-    KEY = getInput(delay_time);
-    if (hadPressed == 1) {
-      c = pgm_read_byte(&KeyMap[KEY - 1][Mode]);
-      if ((Mode == 1) || (Mode == 3) || (Mode == 5)) {
-        Mode = 0;
-        _shift = 0;
-        _sym = 0;
-        _fn = 0;
-      }
-      hadPressed = 0;
-    }
-  }
-  idle < 8 ?  idle++ : idle = 0;
+// the next key typed, or 0 if there is none
+byte getChar(void) {
+  if (keyTail == keyHead) return 0;
+  byte c = keyBuf[keyTail];
+  keyTail = (keyTail + 1) % KEYBUF_SIZE;
+  if (c == 0x1B) escTyped = false;
   return c;
 }
+
+// like getChar(), but an ESC stays in the buffer for escPressed()
+byte getKey(void) {
+  if (escTyped) return 0;
+  return getChar();
+}
+
+// true if ESC has been typed, the other keys waiting are dropped with it
+bool escPressed(void) {
+  if (!escTyped) return false;
+  uint8_t oldSREG = SREG;
+  cli();
+  keyTail = keyHead;
+  escTyped = false;
+  SREG = oldSREG;
+  return true;
+}
@@ -13,7 +13,12 @@
 
 #define NUMPIXELS        1
 #define LEDPIN          13
-#define LONGPRESSEDTIME 15
+#define KEYSCAN_MS       2    // keyScan() is called this often, from the timer 1 interrupt
+#define KEYDEBOUNCE_MS   4    // the keys must read the same this long before a change counts
+#define KEYDELAY_MS    500    // a held key starts repeating after this
+#define KEYREPEAT_MS   100    // and then repeats this often
+#define LONGPRESSEDTIME 500   // ms holding shift, sym or fn locks it
+#define KEYBUF_SIZE     16    // keys typed but not read yet
 
 #define shiftPressed (PINB & 0x10 ) == 0x00
 #define fnPressed    (PINB & 0x40 ) == 0x00
@@ -100,7 +105,9 @@ const uint8_t PROGMEM pinBmap[] = {
 
 void flashOn(byte r, byte g, byte b);
 void keybordSetup(void);
-byte getInput(uint8_t);
-byte getChar(uint8_t);
+void keyScan(void);
+byte getChar(void);
+byte getKey(void);
+bool escPressed(void);
 
 #endif
@@ -11,6 +11,7 @@
 
 #include <SSD1306ASCII_I2C.h>
 #include <EEPROM.h>
+#include <util/crc16.h>
 #include "host.h"
 #include "basic.h"
 #include "cardkb.h"
@@ -20,11 +21,50 @@ extern EEPROMClass EEPROM;
 int timer1_counter;
 
 byte screenBuffer[OLED_COLMAX * OLED_ROWMAX];
-byte lineDirty[OLED_ROWMAX];
+// columns of each row changed since it was drawn, none when dirtyFrom > dirtyTo
+byte dirtyFrom[OLED_ROWMAX], dirtyTo[OLED_ROWMAX];
+// where the blinking cursor is drawn on the panel
+#define NO_CURSOR 0xFF
+uint8_t cursorPos = NO_CURSOR;
 uint8_t curX = 0, curY = 0;
 volatile boolean flash = false;
+#if GRAPHICS
+// pixels drawn over the text, one byte per column of each row like the display RAM
+byte pixelBuffer[OLED_ROWMAX][OLED_WIDTH];
+#endif
+#if SPRITES
+// 6x8 images drawn over the text and pixels at any pixel position
+typedef struct {
+  byte cols[6];       // one byte per column, bit 0 at the top
+  int16_t x, y;
+  bool shown;
+} Sprite;
+Sprite sprites[SPRITES];
+void markSprite(Sprite *s);
+void hideSprites();
+#endif
+
+// The panel is updated a few characters at a time from the timer interrupt,
+// so the interpreter carries on while the I2C bus is busy. Each step sends
+// what the buffer holds at that moment, so a row changed while it is being
+// sent is just marked dirty again.
+#define TICK_HZ             500   // timer 1 interrupts per second, 1000 / KEYSCAN_MS
+#define FLUSH_CHARS         5     // characters per step, 30 bytes fit one I2C burst
+volatile uint8_t scrollsPending;  // rows scrolled but not yet sent to the panel
+volatile uint8_t flushHold;       // non zero while the foreground uses the I2C bus
+uint8_t blinkTicks;
+
+// While a program runs the panel is refreshed in frames: each frame is one
+// pass down the rows of at most a screenful of steps, so a loop that prints
+// the same cells over and over only costs one redraw per frame.
+// At the prompt every tick flushes.
+#define FRAME_STEPS         (OLED_ROWMAX * ((OLED_COLMAX + FLUSH_CHARS - 1) / FLUSH_CHARS))
+uint16_t frameTicks = TICK_HZ / 10;   // ticks between frames, 0 for FLUSH only
+uint16_t frameCount;
+uint8_t frameRow;                     // next row of the current frame
+uint8_t frameSteps;                   // steps left in the current frame
+#define FLUSH_DONE          0xFF
 byte inputMode = 0;
-byte inkeyChar = 0;
 
 const char bytesFreeStr[] PROGMEM = "bytes free";
 
@@ -33,16 +73,46 @@ void initTimer() {
   noInterrupts();           // disable all interrupts
   TCCR1A = 0;
   TCCR1B = 0;
-  timer1_counter = 49911;   // preload timer 65536-8MHz/256/2Hz
+  timer1_counter = 65286;   // preload timer 65536-8MHz/64/500Hz
   TCNT1 = timer1_counter;   // preload timer
-  TCCR1B |= (1 << CS12);    // 256 prescaler
+  TCCR1B |= (1 << CS11) | (1 << CS10);    // 64 prescaler
   TIMSK1 |= (1 << TOIE1);   // enable timer overflow interrupt
   interrupts();             // enable all interrupts
 }
 
-ISR(TIMER1_OVF_vect) {      // interrupt service routine
+uint8_t flushStep(uint8_t y);
+
+// ISR_NOBLOCK lets the I2C interrupts run while a flush step uses Wire
+ISR(TIMER1_OVF_vect, ISR_NOBLOCK) {      // interrupt service routine
+  static volatile bool flushing;
   TCNT1 = timer1_counter;   // preload timer
-  flash = !flash;
+  keyScan();
+  if (++blinkTicks == TICK_HZ / 2) {
+    blinkTicks = 0;
+    flash = !flash;
+  }
+  if (inputMode || (frameTicks && ++frameCount >= frameTicks)) {
+    frameCount = 0;
+    frameRow = 0;
+    frameSteps = FRAME_STEPS;
+  }
+  if (flushing || flushHold || !frameSteps) return;
+  flushing = true;
+  frameRow = flushStep(frameRow);
+  if (frameRow >= OLED_ROWMAX) frameSteps = 0;
+  else frameSteps--;
+  flushing = false;
+}
+
+// REFRESH hz: cap the panel refresh while a program runs, 0 to refresh on FLUSH only
+void host_setRefresh(uint16_t hz) {
+  uint16_t ticks = 0;
+  if (hz) ticks = (hz >= TICK_HZ) ? 1 : TICK_HZ / hz;
+  uint8_t oldSREG = SREG;
+  cli();
+  frameTicks = ticks;
+  frameCount = 0;
+  SREG = oldSREG;
 }
 
 void host_init() {
@@ -80,9 +150,39 @@ void host_click() {
 #endif
 }
 
+// the dirty ranges are shared with the flush interrupt
+// so the buffer must be written before it is marked dirty
+void markDirty(uint8_t pos) {
+  uint8_t x = pos % OLED_COLMAX, y = pos / OLED_COLMAX;
+  uint8_t oldSREG = SREG;
+  cli();
+  if (x < dirtyFrom[y]) dirtyFrom[y] = x;
+  if (x > dirtyTo[y]) dirtyTo[y] = x;
+  SREG = oldSREG;
+}
+
+void markRowDirty(uint8_t y) {
+  uint8_t oldSREG = SREG;
+  cli();
+  dirtyFrom[y] = 0;
+  dirtyTo[y] = OLED_COLMAX - 1;
+  SREG = oldSREG;
+}
+
+void markAllDirty() {
+  for (uint8_t y = 0; y < OLED_ROWMAX; y++)
+    markRowDirty(y);
+}
+
 void host_cls() {
   memset(screenBuffer, 0x20, OLED_COLMAX * OLED_ROWMAX);
-  memset(lineDirty, 1, OLED_ROWMAX);
+#if GRAPHICS
+  memset(pixelBuffer, 0, sizeof(pixelBuffer));
+#endif
+#if SPRITES
+  hideSprites();
+#endif
+  markAllDirty();
   curX = 0;
   curY = 0;
 }
@@ -103,46 +203,140 @@ void host_startupTone() {
 }
 
 void host_moveCursor(uint8_t x, uint8_t y) {
-  if (x < 0) x = 0;
   if (x >= OLED_COLMAX) x = OLED_COLMAX - 1;
-  if (y < 0) y = 0;
   if (y >= OLED_ROWMAX) y = OLED_ROWMAX - 1;
   curX = x;
   curY = y;
 }
 
-void host_showBuffer() {
-  uint8_t x, y;
-  for ( y = 0; y < OLED_ROWMAX; y++) {
-    if (lineDirty[y] || (inputMode && y == curY)) {
-      oled.setCursor(0, y);
-      for ( x = 0; x < OLED_COLMAX; x++) {
-        char c = screenBuffer[y * OLED_COLMAX + x];
+// send any pending scroll and the next few changed characters from row y on
+// returns the row to carry on from, or FLUSH_DONE if those rows are up to date
+#if GRAPHICS || SPRITES
+// the pixels and sprites over count display columns of row y from column px
+void buildOverlay(uint8_t y, uint8_t px, uint8_t count, byte *over) {
+#if GRAPHICS
+  memcpy(over, &pixelBuffer[y][px], count);
+#else
+  memset(over, 0, count);
+#endif
+#if SPRITES
+  for (uint8_t n = 0; n < SPRITES; n++) {
+    Sprite *s = &sprites[n];
+    int shift = s->y - y * 8;
+    if (!s->shown || shift <= -8 || shift >= 8) continue;
+    for (uint8_t i = 0; i < 6; i++) {
+      int k = s->x + i - px;
+      if (k < 0 || k >= count) continue;
+      over[k] |= (shift >= 0) ? s->cols[i] << shift : s->cols[i] >> -shift;
+    }
+  }
+#endif
+}
+#endif
+
+uint8_t flushStep(uint8_t y) {
+  uint8_t i, x, n;
+  byte chars[FLUSH_CHARS];
+#if GRAPHICS || SPRITES
+  byte over[FLUSH_CHARS * 6 + 2];
+#endif
+  if (scrollsPending) {
+    oled.scrollUp(scrollsPending);
+    scrollsPending = 0;
+  }
+  for ( ; y < OLED_ROWMAX; y++) {
+    if (dirtyFrom[y] <= dirtyTo[y]) {
+      x = dirtyFrom[y];
+      n = dirtyTo[y] - x + 1;
+      if (n > FLUSH_CHARS) n = FLUSH_CHARS;
+      for ( i = 0; i < n; i++) {
+        char c = screenBuffer[y * OLED_COLMAX + x + i];
         if (c < 0x20) c = ' ';
-        if (x == curX && y == curY && inputMode && flash) c = 0x7f; //Cursor blink
-        oled.write(c);
+        if (y * OLED_COLMAX + x + i == cursorPos) c = 0x7f; //Cursor blink
+        chars[i] = c;
       }
-      lineDirty[y] = 0;
+      bool rowDone = x + n > dirtyTo[y];
+      if (rowDone) {
+        dirtyFrom[y] = OLED_COLMAX;
+        dirtyTo[y] = 0;
+      }
+      else
+        dirtyFrom[y] = x + n;
+#if GRAPHICS || SPRITES
+      if (x == 0) buildOverlay(y, 0, n * 6 + 2, over);
+      else buildOverlay(y, x * 6 + 2, n * 6, over);
+      oled.writeRow(y, x, chars, n, over);
+#else
+      oled.writeRow(y, x, chars, n);
+#endif
+      return rowDone ? y + 1 : y;
     }
   }
+  return FLUSH_DONE;
+}
+
+// hand the changes to the flush interrupt, marking the cursor cell when it
+// blinks or moves
+void host_showBuffer() {
+  uint8_t cursor = (inputMode && flash) ? curY * OLED_COLMAX + curX : NO_CURSOR;
+  if (cursor != cursorPos) {
+    uint8_t oldSREG = SREG;
+    cli();
+    if (cursorPos != NO_CURSOR) markDirty(cursorPos);
+    if (cursor != NO_CURSOR) markDirty(cursor);
+    cursorPos = cursor;
+    SREG = oldSREG;
+  }
+}
+
+// wait until the panel shows the whole buffer
+void host_flushSync() {
+  host_showBuffer();
+  flushHold++;
+  while (flushStep(0) != FLUSH_DONE) ;
+  flushHold--;
 }
 
+// the panel scrolls in hardware, so what it already shows moves up with the
+// buffer and only the new bottom row has to be drawn. Sprites stay where they
+// are, so the cells they scroll into and the ones they are in are redrawn.
 void scrollBuffer() {
-  memcpy(screenBuffer, screenBuffer + OLED_COLMAX, OLED_COLMAX * (OLED_ROWMAX - 1));
+  uint8_t oldSREG = SREG;
+  cli();
+#if SPRITES
+  for (uint8_t n = 0; n < SPRITES; n++)
+    markSprite(&sprites[n]);
+#endif
+  memmove(screenBuffer, screenBuffer + OLED_COLMAX, OLED_COLMAX * (OLED_ROWMAX - 1));
   memset(screenBuffer + OLED_COLMAX * (OLED_ROWMAX - 1), 0x20, OLED_COLMAX);
-  memset(lineDirty, 1, OLED_ROWMAX);
+#if GRAPHICS
+  memmove(pixelBuffer[0], pixelBuffer[1], OLED_WIDTH * (OLED_ROWMAX - 1));
+  memset(pixelBuffer[OLED_ROWMAX - 1], 0, OLED_WIDTH);
+#endif
+  memmove(dirtyFrom, dirtyFrom + 1, OLED_ROWMAX - 1);
+  memmove(dirtyTo, dirtyTo + 1, OLED_ROWMAX - 1);
+  markRowDirty(OLED_ROWMAX - 1);
+#if SPRITES
+  for (uint8_t n = 0; n < SPRITES; n++)
+    markSprite(&sprites[n]);
+#endif
+  if (cursorPos != NO_CURSOR)
+    cursorPos = (cursorPos >= OLED_COLMAX) ? cursorPos - OLED_COLMAX : NO_CURSOR;
+  // a whole turn of the display RAM pages needs no scroll at all
+  scrollsPending = (scrollsPending + 1) % OLED_PAGES;
+  SREG = oldSREG;
   curY--;
 }
 
 void host_outputString(char *str) {
   uint8_t pos = curY * OLED_COLMAX + curX;
   while (*str) {
-    lineDirty[pos / OLED_COLMAX] = 1;
     if (pos >= OLED_COLMAX * OLED_ROWMAX) {
       scrollBuffer();
       pos -= OLED_COLMAX;
     }
-    screenBuffer[pos++] = *str++;
+    screenBuffer[pos] = *str++;
+    markDirty(pos++);
   }
   curX = pos % OLED_COLMAX;
   curY = pos / OLED_COLMAX;
@@ -161,13 +355,13 @@ void host_outputChar(char c) {
 }
 void host_outputChar(char c, bool pause) {
   uint8_t pos = curY * OLED_COLMAX + curX;
-  lineDirty[pos / OLED_COLMAX] = 1;
-  screenBuffer[pos++] = c;
+  screenBuffer[pos] = c;
+  markDirty(pos++);
   if (pos >= OLED_COLMAX * OLED_ROWMAX) {
-    host_showBuffer();
     if (pause) {
+      host_flushSync();
       while (1) {
-        if (getChar(0) != 0x00)break;
+        if (getChar() != 0x00)break;
       }
     }
     scrollBuffer();
@@ -179,18 +373,24 @@ void host_outputChar(char c, bool pause) {
 
 int host_outputInt(long num) {
   // returns len
-  long i = num, xx = 1;
   int c = 0;
-  do {
+  if (num < 0) {
+    host_outputChar('-');
     c++;
+  }
+  // the digits of the magnitude, which LONG_MIN has too
+  uint32_t n = num < 0 ? 0UL - (uint32_t)num : num;
+  uint32_t i = n, xx = 1;
+  int digits = 0;
+  while (i >= 10) {
+    digits++;
     xx *= 10;
     i /= 10;
   }
-  while (i);
-
-  for ( i = 0; i < c; i++) {
+  for (; digits >= 0; digits--) {
+    host_outputChar((n / xx) % 10 + '0');
     xx /= 10;
-    host_outputChar(((num / xx) % 10) + '0');
+    c++;
   }
   return c;
 }
@@ -235,22 +435,25 @@ void host_newLine(bool pause) {
   curX = 0;
   curY++;
   if (curY == OLED_ROWMAX) {
-    host_showBuffer();
     if (pause) {
+      host_flushSync();
       while (1) {
-        if (getChar(0) != 0x00)break;
+        if (getChar() != 0x00)break;
       }
     }
     scrollBuffer();
   }
   memset(screenBuffer + OLED_COLMAX * (curY), 0x20, OLED_COLMAX);
-  lineDirty[curY] = 1;
+  markRowDirty(curY);
 }
 
 char *host_readLine() {
   inputMode = 1;
 
-  if (curX == 0) memset(screenBuffer + OLED_COLMAX * (curY), 0x20, OLED_COLMAX);
+  if (curX == 0) {
+    memset(screenBuffer + OLED_COLMAX * (curY), 0x20, OLED_COLMAX);
+    markRowDirty(curY);
+  }
   else host_newLine();
 
   uint8_t startPos = curY * OLED_COLMAX + curX;
@@ -259,14 +462,17 @@ char *host_readLine() {
   bool done = false;
   char c;
   while (!done) {
-    while (c = getChar(200)) {
+    while ((c = getChar())) {
       host_click();
       // read the next key
-      lineDirty[pos / OLED_COLMAX] = 1;
-      if ( 0x20 <= c && c < 0x7f)
-        screenBuffer[pos++] = c;
-      else if (c == 0x08 && pos > startPos) //DELETE
+      if ( 0x20 <= c && c < 0x7f) {
+        screenBuffer[pos] = c;
+        markDirty(pos++);
+      }
+      else if (c == 0x08 && pos > startPos) { //DELETE
         screenBuffer[--pos] = 0;
+        markDirty(pos);
+      }
       else if (c == 0x0D) // ENTER
         done = true;
       curX = pos % OLED_COLMAX;
@@ -281,6 +487,7 @@ char *host_readLine() {
         else
         {
           screenBuffer[--pos] = 0;
+          markDirty(pos);
           curX = pos % OLED_COLMAX;
           curY = pos / OLED_COLMAX;
         }
@@ -291,26 +498,19 @@ char *host_readLine() {
   }
   screenBuffer[pos] = 0;
   inputMode = 0;
-  // remove the cursor
-  lineDirty[curY] = 1;
-  host_showBuffer();
-  return &screenBuffer[startPos];
+  host_showBuffer();	// removes the cursor
+  return (char*)&screenBuffer[startPos];
 }
 
 char host_getKey() {
-  char c = inkeyChar;
-  inkeyChar = 0;
+  char c = getKey();
   if (0x20 <= c && c < 0x7f)
     return c;
   else return 0;
 }
 
 bool host_ESCPressed() {
-  inkeyChar = getChar(0);
-  if (inkeyChar == 0x1B)//ESC
-    return true;
-  else
-    return false;
+  return escPressed();
 }
 
 void host_outputFreeMem(uint16_t val)
@@ -321,30 +521,147 @@ void host_outputFreeMem(uint16_t val)
   host_outputProgMemString(bytesFreeStr);
 }
 
-void host_saveProgram(bool autoexec) {
-  EEPROM.write(0, autoexec ? MAGIC_AUTORUN_NUMBER : 0x00);
-  EEPROM.write(1, sysPROGEND & 0xFF);
-  EEPROM.write(2, (sysPROGEND >> 8) & 0xFF);
+// SAVE puts the program in the EEPROM as an image starting on the next
+// multiple of IMAGE_SLOT after the newest one, back at the start when it
+// would not fit before the end, so repeated SAVEs spread the wear.
+// Each image has a header, written last: IMAGE_MAGIC, the autorun byte, a
+// sequence number, the length and a CRC of the rest. LOAD takes the valid
+// image with the highest sequence number.
+#define IMAGE_MAGIC         0xA5
+#define IMAGE_HEADER        8
+#define IMAGE_SLOT          128   // smallest slot, images start on a multiple of it
+
+int16_t imageAddr = -1;           // the newest image, -1 if there is none
+uint16_t imageSeq;
+bool imageFound = false;          // the EEPROM has been searched for it
+
+uint16_t readEEPROMWord(int addr) {
+  return EEPROM.read(addr) | (EEPROM.read(addr + 1) << 8);
+}
+
+// CRC of an image from the autorun byte to the end, leaving out the CRC
+uint16_t imageCRC(int addr, uint16_t len) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 1; i < IMAGE_HEADER - 2; i++)
+    crc = _crc16_update(crc, EEPROM.read(addr + i));
+  for (int i = 0; i < len; i++)
+    crc = _crc16_update(crc, EEPROM.read(addr + IMAGE_HEADER + i));
+  return crc;
+}
+
+void findImage() {
+  imageAddr = -1;
+  for (int addr = 0; addr < EEPROM.length(); addr += IMAGE_SLOT) {
+    if (EEPROM.read(addr) != IMAGE_MAGIC) continue;
+    uint16_t len = readEEPROMWord(addr + 4);
+    if (len > MEMORY_SIZE || addr + IMAGE_HEADER + len > EEPROM.length()) continue;
+    if (imageCRC(addr, len) != readEEPROMWord(addr + 6)) continue;
+    uint16_t seq = readEEPROMWord(addr + 2);
+    if (imageAddr < 0 || (int16_t)(seq - imageSeq) > 0) {
+      imageAddr = addr;
+      imageSeq = seq;
+    }
+  }
+  imageFound = true;
+}
+
+// Before images, SAVE wrote the autorun byte at 0, the length at 1 and the
+// program from 3. With no valid image this is read instead, if its lines
+// add up to its length. A blank EEPROM of 0s reads as an empty program.
+#define LEGACY_HEADER       3
+
+bool isLegacyProgram() {
+  uint16_t len = readEEPROMWord(1);
+  if (len > MEMORY_SIZE || LEGACY_HEADER + len > EEPROM.length()) return false;
+  uint16_t i = 0;
+  while (i < len) {
+    uint16_t lineLen = readEEPROMWord(LEGACY_HEADER + i);
+    if (lineLen < 4) return false;
+    i += lineLen;
+  }
+  return i == len;
+}
+
+// true if the program SAVEd should run at power on
+bool host_autorun() {
+  if (!imageFound) findImage();
+  if (imageAddr < 0)
+    return EEPROM.read(0) == MAGIC_AUTORUN_NUMBER && isLegacyProgram();
+  return EEPROM.read(imageAddr + 1) == MAGIC_AUTORUN_NUMBER;
+}
+
+bool host_saveProgram(bool autoexec) {
+  uint8_t autorun = autoexec ? MAGIC_AUTORUN_NUMBER : 0x00;
+  if (!imageFound) findImage();
+  if (IMAGE_HEADER + sysPROGEND > EEPROM.length()) return false;
+
+  // nothing to write if the newest image is this program already
+  if (imageAddr >= 0 && EEPROM.read(imageAddr + 1) == autorun && readEEPROMWord(imageAddr + 4) == sysPROGEND) {
+    int i = 0;
+    while (i < sysPROGEND && EEPROM.read(imageAddr + IMAGE_HEADER + i) == mem[i]) i++;
+    if (i == sysPROGEND) return true;
+  }
+
+  int addr = 0;
+  if (imageAddr >= 0) {
+    int end = imageAddr + IMAGE_HEADER + readEEPROMWord(imageAddr + 4);
+    addr = (end + IMAGE_SLOT - 1) / IMAGE_SLOT * IMAGE_SLOT;
+    if (addr + IMAGE_HEADER + sysPROGEND > EEPROM.length()) addr = 0;
+    // A program more than about half the size of the EEPROM has no room
+    // beside the newest image, so it is written over it at the start. Until
+    // the CRC is written neither is valid, and an interrupted SAVE leaves
+    // only older images, if any.
+  }
+
+  // update() only writes the bytes that differ from what is there
   for (int i = 0; i < sysPROGEND; i++)
-    EEPROM.write(3 + i, mem[i]);
+    EEPROM.update(addr + IMAGE_HEADER + i, mem[i]);
+  imageSeq++;
+  EEPROM.update(addr + 1, autorun);
+  EEPROM.update(addr + 2, imageSeq & 0xFF);
+  EEPROM.update(addr + 3, (imageSeq >> 8) & 0xFF);
+  EEPROM.update(addr + 4, sysPROGEND & 0xFF);
+  EEPROM.update(addr + 5, (sysPROGEND >> 8) & 0xFF);
+  uint16_t crc = imageCRC(addr, sysPROGEND);
+  EEPROM.update(addr + 6, crc & 0xFF);
+  EEPROM.update(addr + 7, (crc >> 8) & 0xFF);
+  EEPROM.update(addr, IMAGE_MAGIC);
+  imageAddr = addr;
+  return true;
 }
 
-void host_loadProgram() {
-  // skip the autorun byte
-  sysPROGEND = EEPROM.read(1) | (EEPROM.read(2) << 8);
+// false if there is no valid program (the program is left empty)
+bool host_loadProgram() {
+  if (!imageFound) findImage();
+  int addr = imageAddr + IMAGE_HEADER;
+  if (imageAddr >= 0)
+    sysPROGEND = readEEPROMWord(imageAddr + 4);
+  else if (isLegacyProgram()) {
+    addr = LEGACY_HEADER;
+    sysPROGEND = readEEPROMWord(1);
+  }
+  else return false;
   for (int i = 0; i < sysPROGEND; i++)
-    mem[i] = EEPROM.read(i + 3);
+    mem[i] = EEPROM.read(addr + i);
+  return true;
 }
 
+// keyScan() sets the LED from the timer interrupt too, so it must not run
+// in the middle of this
 void host_LED(uint8_t r, uint8_t g, uint8_t b) {
+  uint8_t oldSREG = SREG;
+  cli();
   flashOn(r, g, b);
+  SREG = oldSREG;
 }
 
-void host_Img( uint8_t *imgBuff) {
+// decode 12 hex digits, two per column with the bottom row in bit 0,
+// into 6 column bytes for the display (top row in bit 0)
+void decodeImg(const uint8_t *imgBuff, uint8_t *buf) {
   uint8_t i, v;
-  uint8_t buf[6];
-  for (i = 0; i < 12; i++) {
-    v = *(imgBuff + i);
+  memset(buf, 0, 6);
+  for (i = 0; i < 12 && imgBuff[i]; i++) {
+    v = imgBuff[i];
     if ( '0' <= v && v <= '9' )
       v = v - '0';
     else if ( 'A' <= v && v <= 'F' )
@@ -357,91 +674,471 @@ void host_Img( uint8_t *imgBuff) {
     v = ((v & 0x0c) >> 2) | ((v & 0x03) << 2);
     v = ((v & 0x0a) >> 1) | ((v & 0x05) << 1);
     if ( i % 2 == 0)
-      buf[i / 2] += v ;
+      buf[i / 2] = v;
     else
-      buf[i / 2] = v << 4;
+      buf[i / 2] |= v << 4;
   }
+}
+
+void host_Img( uint8_t *imgBuff) {
+  uint8_t buf[6];
+  decodeImg(imgBuff, buf);
+  // draw after the pending text, which would otherwise be flushed over it
+  host_flushSync();
+  flushHold++;
   oled.setCursor(curX, curY);
   oled.setImg(buf);
+  flushHold--;
+}
+
+// pixels are drawn with the text cell they fall in, the two columns left of
+// the text belong to the first cell
+#define PIXEL_CELL(x)       ((x) < 2 ? 0 : ((x) - 2) / 6)
+
+#if GRAPHICS
+void host_plot(int x, int y, uint8_t on) {
+  if (x < 0 || x >= OLED_WIDTH || y < 0 || y >= OLED_ROWMAX * 8) return;
+  byte *p = &pixelBuffer[y >> 3][x];
+  byte old = *p;
+  if (on) *p |= 1 << (y & 7);
+  else *p &= ~(1 << (y & 7));
+  if (*p != old)
+    markDirty((y >> 3) * OLED_COLMAX + PIXEL_CELL(x));
+}
+
+uint8_t host_point(int x, int y) {
+  if (x < 0 || x >= OLED_WIDTH || y < 0 || y >= OLED_ROWMAX * 8) return 0;
+  return (pixelBuffer[y >> 3][x] >> (y & 7)) & 1;
+}
+
+// Bresenham's line
+void host_line(int x1, int y1, int x2, int y2, uint8_t on) {
+  int dx = abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
+  int dy = -abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
+  int err = dx + dy;
+  while (1) {
+    host_plot(x1, y1, on);
+    if (x1 == x2 && y1 == y2) break;
+    int e2 = 2 * err;
+    if (e2 >= dy) {
+      err += dy;
+      x1 += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      y1 += sy;
+    }
+  }
+}
+
+void host_rect(int x1, int y1, int x2, int y2, uint8_t on) {
+  host_line(x1, y1, x2, y1, on);
+  host_line(x2, y1, x2, y2, on);
+  host_line(x2, y2, x1, y2, on);
+  host_line(x1, y2, x1, y1, on);
+}
+#endif
+
+#if SPRITES
+// mark the text cells under a sprite
+void markSprite(Sprite *s) {
+  if (!s->shown) return;
+  int x1 = max(s->x, 0), x2 = min(s->x + 5, OLED_WIDTH - 1);
+  int y1 = max(s->y, 0), y2 = min(s->y + 7, OLED_ROWMAX * 8 - 1);
+  if (x1 > x2 || y1 > y2) return;
+  for (int r = y1 >> 3; r <= y2 >> 3; r++)
+    for (int c = PIXEL_CELL(x1); c <= PIXEL_CELL(x2); c++)
+      markDirty(r * OLED_COLMAX + c);
+}
+
+// the image is decoded once here, so moving a sprite costs no parsing
+void host_defineSprite(uint8_t n, const char *hex) {
+  Sprite *s = &sprites[n];
+  markSprite(s);
+  decodeImg((const uint8_t *)hex, s->cols);
+  markSprite(s);
 }
 
+// the old and new places are both redrawn by the next flush
+void host_moveSprite(uint8_t n, int x, int y) {
+  Sprite *s = &sprites[n];
+  markSprite(s);
+  s->x = x;
+  s->y = y;
+  s->shown = true;
+  markSprite(s);
+}
+
+void hideSprites() {
+  for (uint8_t n = 0; n < SPRITES; n++) {
+    markSprite(&sprites[n]);
+    sprites[n].shown = false;
+  }
+}
+
+// 1 if two shown sprites have a pixel in the same place
+uint8_t host_spriteHit(uint8_t a, uint8_t b) {
+  Sprite *p = &sprites[a], *q = &sprites[b];
+  if (!p->shown || !q->shown) return 0;
+  int dx = q->x - p->x, dy = q->y - p->y;
+  if (dx <= -6 || dx >= 6 || dy <= -8 || dy >= 8) return 0;
+  for (int i = max(dx, 0); i < min(6, 6 + dx); i++) {
+    uint16_t pc = p->cols[i], qc = q->cols[i - dx];
+    if (dy >= 0 ? pc & (qc << dy) : (pc << -dy) & qc) return 1;
+  }
+  return 0;
+}
+#endif
+
 //-----------------------------------------------------------------------------
 
 #if EXTERNAL_EEPROM
 #include <Wire.h>
 
-void writeExtEEPROM(uint16_t address, uint8_t data) {
-  uint8_t i2caddr = (uint8_t)EXTERNAL_EEPROM_ADDR | (uint8_t)(address >> 16);
-  Wire.beginTransmission(i2caddr);
-  Wire.write((byte)(address >> 8));   // MSB
-  Wire.write((byte)(address & 0xFF)); // LSB
+#define EXT_EEPROM_PAGE     64    // 24LCxx page, one write must not cross it
+#define EXT_EEPROM_CHUNK    30    // Wire's 32 byte buffer less the 2 address bytes
+#define EXT_EEPROM_BURST    32    // bytes per read, Wire's buffer
+#define EXT_EEPROM_WAIT     10    // ms to wait for a write cycle before giving up
+#define EXT_EEPROM_GEN      (EXTERNAL_EEPROM_SIZE - 1)  // generation byte, changed by SAVE and DELETE
+#define EXT_DELETED         0x8000  // length flag of a deleted file, COMPACT removes it
+
+uint16_t extWriteAddr;            // next address to write
+uint8_t extWriteLen;              // bytes in the Wire transmission being built
+uint16_t extReadAddr;             // address of the next burst to read
+uint8_t extReadLeft;              // bytes of the last burst not read yet
+
+// The directory index: where the first EXT_DIR_FILES files are, so that a
+// file command only reads the generation byte and checks the name.
+typedef struct {
+  uint8_t hash;                   // of the file name
+  uint16_t addr;                  // of the record
+  uint16_t len;                   // of the record
+} ExtDirEntry;
+ExtDirEntry extDir[EXT_DIR_FILES];
+uint8_t extDirCount;
+bool extDirMore;                  // there are files after the last one indexed
+bool extDirValid;
+uint8_t extDirGen;                // generation byte the index was built for
+uint16_t extDirEnd;               // address of the 0 length after the last file
+uint16_t extDirDead;              // bytes of deleted files
+void endWriteExtEEPROM();
+
+// wait for the last write cycle to finish, the chip does not ACK until it has
+void waitExtEEPROM() {
+  uint32_t start = millis();
+  do {
+    Wire.beginTransmission((uint8_t)EXTERNAL_EEPROM_ADDR);
+  } while (Wire.endTransmission() != 0 && millis() - start < EXT_EEPROM_WAIT);
+}
+
+// Writes are collected into one Wire transmission until it is full or
+// reaches the end of a page, then sent as a page write.
+void beginWriteExtEEPROM(uint16_t address) {
+  extWriteAddr = address;
+  extWriteLen = 0;
+}
+
+void writeNextExtEEPROM(uint8_t data) {
+  if (extWriteLen == 0) {
+    uint8_t i2caddr = (uint8_t)EXTERNAL_EEPROM_ADDR | (uint8_t)(extWriteAddr >> 16);
+    flushHold++;   // keep the display flush off the bus
+    waitExtEEPROM();
+    Wire.beginTransmission(i2caddr);
+    Wire.write((byte)(extWriteAddr >> 8));   // MSB
+    Wire.write((byte)(extWriteAddr & 0xFF)); // LSB
+  }
   Wire.write(data);
+  extWriteLen++;
+  extWriteAddr++;
+  if (extWriteLen == EXT_EEPROM_CHUNK || extWriteAddr % EXT_EEPROM_PAGE == 0)
+    endWriteExtEEPROM();
+}
+
+void endWriteExtEEPROM() {
+  if (extWriteLen == 0) return;
   Wire.endTransmission();
-  delay(5);
+  flushHold--;
+  extWriteLen = 0;
+}
+
+void writeExtEEPROM(uint16_t address, uint8_t data) {
+  beginWriteExtEEPROM(address);
+  writeNextExtEEPROM(data);
+  endWriteExtEEPROM();
 }
 
 byte readExtEEPROM(uint16_t address)
 {
   uint8_t i2caddr = (uint8_t)EXTERNAL_EEPROM_ADDR | (uint8_t)(address >> 16);
+  // this takes over Wire's receive buffer, so the cursor asks again
+  extReadAddr -= extReadLeft;
+  extReadLeft = 0;
+  flushHold++;
+  waitExtEEPROM();
   Wire.beginTransmission(i2caddr);
   Wire.write((byte)(address >> 8));   // MSB
   Wire.write((byte)(address & 0xFF)); // LSB
   Wire.endTransmission();
   Wire.requestFrom(i2caddr, (uint8_t)1);
   byte b = Wire.read();
+  flushHold--;
   return b;
 }
 
-// get the EEPROM address of a file, or the end if fileName is null
-uint16_t getExtEEPROMAddr(char *fileName) {
+// Reads set the address once and then take up to EXT_EEPROM_BURST bytes
+// per request, the next burst carrying on from where the last one ended.
+// The bytes wait in Wire's receive buffer, so only one read at a time.
+void beginReadExtEEPROM(uint16_t address) {
+  extReadAddr = address;
+  extReadLeft = 0;
+}
+
+byte readNextExtEEPROM() {
+  if (extReadLeft == 0) {
+    uint8_t i2caddr = (uint8_t)EXTERNAL_EEPROM_ADDR | (uint8_t)(extReadAddr >> 16);
+    flushHold++;
+    waitExtEEPROM();
+    Wire.beginTransmission(i2caddr);
+    Wire.write((byte)(extReadAddr >> 8));   // MSB
+    Wire.write((byte)(extReadAddr & 0xFF)); // LSB
+    Wire.endTransmission();
+    extReadLeft = Wire.requestFrom(i2caddr, (uint8_t)EXT_EEPROM_BURST);
+    flushHold--;
+    if (extReadLeft == 0) return 0;   // no EEPROM
+    extReadAddr += extReadLeft;
+  }
+  extReadLeft--;
+  return Wire.read();
+}
+
+// the next two bytes, low byte first
+uint16_t readNextWordExtEEPROM() {
+  uint16_t w = readNextExtEEPROM();
+  return w | (readNextExtEEPROM() << 8);
+}
+
+uint8_t hashName(uint8_t h, char c) {
+  return (uint8_t)((h << 1) | (h >> 7)) ^ c;
+}
+
+// (re)build the index if it is missing or the files have changed since
+void checkExtDir() {
+  uint8_t gen = readExtEEPROM(EXT_EEPROM_GEN);
+  if (extDirValid && gen == extDirGen) return;
   uint16_t addr = 0;
+  extDirCount = 0;
+  extDirMore = false;
+  extDirDead = 0;
   while (1) {
-    uint16_t len = readExtEEPROM(addr) | (readExtEEPROM(addr + 1) << 8);
+    beginReadExtEEPROM(addr);
+    uint16_t len = readNextWordExtEEPROM();
     if (len == 0) break;
-    if (fileName) {
-      bool found = true;
-      for (int i = 0; i <= strlen(fileName); i++) {
-        if (fileName[i] != readExtEEPROM(addr + 2 + i)) {
-          found = false;
-          break;
-        }
-      }
-      if (found) return addr;
+    if (len & EXT_DELETED) {
+      len &= ~EXT_DELETED;
+      extDirDead += len;
+    }
+    else if (extDirCount < EXT_DIR_FILES) {
+      uint8_t h = 0;
+      char c;
+      while ((c = readNextExtEEPROM())) h = hashName(h, c);
+      extDir[extDirCount].hash = h;
+      extDir[extDirCount].addr = addr;
+      extDir[extDirCount].len = len;
+      extDirCount++;
     }
+    else extDirMore = true;
     addr += len;
   }
-  return fileName ? EXTERNAL_EEPROM_SIZE : addr;
+  extDirEnd = addr;
+  extDirGen = gen;
+  extDirValid = true;
+}
+
+// after a SAVE, DELETE or COMPACT, so another index of these files is rebuilt
+void touchExtDir() {
+  writeExtEEPROM(EXT_EEPROM_GEN, ++extDirGen);
+}
+
+// true if the record at addr is fileName
+bool isExtFile(uint16_t addr, char *fileName) {
+  beginReadExtEEPROM(addr + 2);
+  for (int i = 0; i <= (int)strlen(fileName); i++) {
+    if (fileName[i] != readNextExtEEPROM())
+      return false;
+  }
+  return true;
+}
+
+// get the EEPROM address of a file, or the end if fileName is null
+uint16_t getExtEEPROMAddr(char *fileName) {
+  checkExtDir();
+  if (!fileName) return extDirEnd;
+  uint8_t h = 0;
+  for (char *p = fileName; *p; p++) h = hashName(h, *p);
+  for (uint8_t i = 0; i < extDirCount; i++) {
+    if (extDir[i].hash == h && isExtFile(extDir[i].addr, fileName))
+      return extDir[i].addr;
+  }
+  if (extDirMore) {
+    // walk on from the last file indexed
+    uint16_t addr = extDir[extDirCount - 1].addr + extDir[extDirCount - 1].len;
+    while (1) {
+      beginReadExtEEPROM(addr);
+      uint16_t len = readNextWordExtEEPROM();
+      if (len == 0) break;
+      if (!(len & EXT_DELETED) && isExtFile(addr, fileName)) return addr;
+      addr += len & ~EXT_DELETED;
+    }
+  }
+  return EXTERNAL_EEPROM_SIZE;
 }
 
 void host_directoryExtEEPROM() {
-  uint16_t addr = 0;
+  uint16_t addr = 0, dead = 0;
   while (1) {
-    uint16_t len = readExtEEPROM(addr) | (readExtEEPROM(addr + 1) << 8);
+    beginReadExtEEPROM(addr);
+    uint16_t len = readNextWordExtEEPROM();
     if (len == 0) break;
-    int i = 0;
-    while (1) {
-      char ch = readExtEEPROM(addr + 2 + i);
-      if (!ch) break;
-      host_outputChar(readExtEEPROM(addr + 2 + i), true);
-      i++;
+    if (len & EXT_DELETED) {
+      len &= ~EXT_DELETED;
+      dead += len;
+    }
+    else {
+      while (1) {
+        char ch = readNextExtEEPROM();
+        if (!ch) break;
+        host_outputChar(ch, true);
+      }
+      host_outputChar(' ', true);
     }
     addr += len;
-    host_outputChar(' ', true);
   }
-  host_outputFreeMem(EXTERNAL_EEPROM_SIZE - addr - 2);
+  // deleted files count as free, SAVE compacts when it needs their space
+  host_outputFreeMem(EXT_EEPROM_GEN - addr - 2 + dead);
+}
+
+// mark the file at addr deleted, the space is reused after COMPACT
+void removeExtFile(uint16_t addr) {
+  beginReadExtEEPROM(addr);
+  uint16_t len = readNextWordExtEEPROM();
+  writeExtEEPROM(addr + 1, (len | EXT_DELETED) >> 8);
+
+  uint8_t j = 0;
+  for (uint8_t i = 0; i < extDirCount; i++) {
+    if (extDir[i].addr != addr)
+      extDir[j++] = extDir[i];
+  }
+  extDirCount = j;
+  extDirDead += len;
+  if (extDirMore) extDirValid = false;  // one that was not indexed now fits
+}
+
+// write the length of the record at addr, the link to the next one
+void writeExtLen(uint16_t addr, uint16_t len) {
+  beginWriteExtEEPROM(addr);
+  writeNextExtEEPROM(len & 0xFF);
+  writeNextExtEEPROM((len >> 8) & 0xFF);
+  endWriteExtEEPROM();
+}
+
+// copy count bytes to a lower address, or to one they do not overlap
+void moveExtEEPROM(uint16_t from, uint16_t to, uint16_t count) {
+  byte buf[EXT_EEPROM_CHUNK];
+  beginReadExtEEPROM(from);
+  while (count) {
+    // read what fits in one page write, then write it
+    uint8_t n = EXT_EEPROM_PAGE - to % EXT_EEPROM_PAGE;
+    if (n > EXT_EEPROM_CHUNK) n = EXT_EEPROM_CHUNK;
+    if (n > count) n = count;
+    for (uint8_t i = 0; i < n; i++)
+      buf[i] = readNextExtEEPROM();
+    beginWriteExtEEPROM(to);
+    for (uint8_t i = 0; i < n; i++)
+      writeNextExtEEPROM(buf[i]);
+    endWriteExtEEPROM();
+    to += n;
+    count -= n;
+  }
+}
+
+void moveExtDirEntry(uint16_t from, uint16_t to, uint16_t len) {
+  for (uint8_t i = 0; i < extDirCount; i++) {
+    if (extDir[i].addr == from) {
+      extDir[i].addr = to;
+      extDir[i].len = len;
+    }
+  }
+}
+
+// COMPACT: move the files down over the deleted ones
+// A file is copied first and linked in after, then the old copy deleted, so
+// a reset in between leaves it in the chain twice rather than losing it:
+// - if the deleted bytes below it can hold it, it goes there, and what is
+//   left of the gap gets a tombstone (or, under 2 bytes, pads the copy)
+// - otherwise it is appended after the last file, if there is room, and
+//   moved down over its old place later on
+// - otherwise it is moved down over itself. Until that copy is done the
+//   chain is broken, and a reset loses this file and the ones after it.
+// Each length is written with one page write, unless it straddles a page.
+void host_compactExtEEPROM() {
+  checkExtDir();
+  if (extDirDead == 0) return;
+  uint16_t end = extDirEnd;   // files appended from here on are not appended again
+  uint16_t from = 0, to = 0;
+  while (1) {
+    beginReadExtEEPROM(from);
+    uint16_t len = readNextWordExtEEPROM();
+    if (len == 0) break;
+    if (len & EXT_DELETED) {
+      from += len & ~EXT_DELETED;
+      continue;
+    }
+    uint16_t newLen = len;
+    if (from != to) {
+      // one tombstone over the whole gap, so the copy can go over the ones in it
+      uint16_t gap = from - to;
+      writeExtLen(to, gap | EXT_DELETED);
+      if (len <= gap) {
+        if (gap - len < 2) newLen = gap;
+        moveExtEEPROM(from + 2, to + 2, len - 2);
+        if (newLen < gap) writeExtLen(to + newLen, (gap - newLen) | EXT_DELETED);
+        writeExtLen(to, newLen);
+        writeExtEEPROM(from + 1, (len | EXT_DELETED) >> 8);
+        moveExtDirEntry(from, to, newLen);
+      }
+      else if (from < end && (uint32_t)extDirEnd + len + 2 <= EXT_EEPROM_GEN) {
+        uint16_t addr = extDirEnd;
+        moveExtEEPROM(from + 2, addr + 2, len - 2);
+        writeExtLen(addr + len, 0);
+        writeExtLen(addr, len);
+        writeExtEEPROM(from + 1, (len | EXT_DELETED) >> 8);
+        moveExtDirEntry(from, addr, len);
+        extDirEnd = addr + len;
+        from += len;
+        continue;
+      }
+      else {
+        moveExtEEPROM(from, to, len);
+        moveExtDirEntry(from, to, len);
+      }
+    }
+    from += len;
+    to += newLen;
+  }
+  // 0 length marks end
+  writeExtLen(to, 0);
+  extDirEnd = to;
+  extDirDead = 0;
+  touchExtDir();
+  // a file appended above may now be past ones the index does not hold
+  if (extDirMore) extDirValid = false;
 }
 
 bool host_removeExtEEPROM(char *fileName) {
   uint16_t addr = getExtEEPROMAddr(fileName);
   if (addr == EXTERNAL_EEPROM_SIZE) return false;
-  uint16_t len = readExtEEPROM(addr) | (readExtEEPROM(addr + 1) << 8);
-  uint16_t last = getExtEEPROMAddr(NULL);
-  uint16_t count = 2 + last - (addr + len);
-  while (count--) {
-    byte b = readExtEEPROM(addr + len);
-    writeExtEEPROM(addr, b);
-    addr++;
-  }
+  removeExtFile(addr);
+  touchExtDir();
   return true;
 }
 
@@ -450,44 +1147,73 @@ bool host_loadExtEEPROM(char *fileName) {
   if (addr == EXTERNAL_EEPROM_SIZE) return false;
 
   // skip filename
-  addr += 2;
-  while (readExtEEPROM(addr++)) ;
-  sysPROGEND = readExtEEPROM(addr) | (readExtEEPROM(addr + 1) << 8);
+  beginReadExtEEPROM(addr + 2);
+  while (readNextExtEEPROM()) ;
+  sysPROGEND = readNextWordExtEEPROM();
   for (uint16_t i = 0; i < sysPROGEND; i++) {
-    mem[i] = readExtEEPROM(addr + 2 + i);
+    mem[i] = readNextExtEEPROM();
   }
   return true;
 }
 
 bool host_saveExtEEPROM(char *fileName) {
   uint16_t i;
-  uint16_t addr = getExtEEPROMAddr(fileName);
-  if (addr != EXTERNAL_EEPROM_SIZE)
-    host_removeExtEEPROM(fileName);
-  addr = getExtEEPROMAddr(NULL);
+  uint16_t old = getExtEEPROMAddr(fileName);
   uint8_t fileNameLen = strlen(fileName);
   uint16_t len = 2 + fileNameLen + 1 + 2 + sysPROGEND;
-  if ((uint16_t)EXTERNAL_EEPROM_SIZE - addr - len - 2 < 0)
-    return false;
-
-  // write overall length
-  writeExtEEPROM(addr++, len & 0xFF);
-  writeExtEEPROM(addr++, (len >> 8) & 0xFF);
+  if ((uint32_t)extDirEnd + len + 2 > EXT_EEPROM_GEN) {
+    // see if deleted files, and the old copy, would make room
+    uint16_t oldLen = 0;
+    if (old != EXTERNAL_EEPROM_SIZE) {
+      beginReadExtEEPROM(old);
+      oldLen = readNextWordExtEEPROM();
+    }
+    if ((uint32_t)extDirEnd + len + 2 > (uint32_t)EXT_EEPROM_GEN + extDirDead + oldLen)
+      return false;
+    if ((uint32_t)extDirEnd + len + 2 > (uint32_t)EXT_EEPROM_GEN + extDirDead) {
+      // only room without the old copy, which has to go first: a reset
+      // before the new one is written loses the file
+      removeExtFile(old);
+      old = EXTERNAL_EEPROM_SIZE;
+    }
+    host_compactExtEEPROM();
+    if (old != EXTERNAL_EEPROM_SIZE) old = getExtEEPROMAddr(fileName);
+  }
+  uint16_t addr = extDirEnd;
 
+  // the file goes in after the end, and the length linking it in is written last
+  beginWriteExtEEPROM(addr + 2);
   // write filename
-  for ( i = 0; i < strlen(fileName); i++)
-    writeExtEEPROM(addr++, fileName[i]);
-  writeExtEEPROM(addr++, 0);
+  for ( i = 0; i <= fileNameLen; i++)
+    writeNextExtEEPROM(fileName[i]);
 
   // write length & program
-  writeExtEEPROM(addr++, sysPROGEND & 0xFF);
-  writeExtEEPROM(addr++, (sysPROGEND >> 8) & 0xFF);
+  writeNextExtEEPROM(sysPROGEND & 0xFF);
+  writeNextExtEEPROM((sysPROGEND >> 8) & 0xFF);
   for ( i = 0; i < sysPROGEND; i++)
-    writeExtEEPROM(addr++, mem[i]);
+    writeNextExtEEPROM(mem[i]);
 
   // 0 length marks end
-  writeExtEEPROM(addr++, 0);
-  writeExtEEPROM(addr++, 0);
+  writeNextExtEEPROM(0);
+  writeNextExtEEPROM(0);
+  endWriteExtEEPROM();
+  // write overall length
+  writeExtLen(addr, len);
+
+  uint8_t h = 0;
+  for (i = 0; i < fileNameLen; i++) h = hashName(h, fileName[i]);
+  if (extDirCount < EXT_DIR_FILES) {
+    extDir[extDirCount].hash = h;
+    extDir[extDirCount].addr = addr;
+    extDir[extDirCount].len = len;
+    extDirCount++;
+  }
+  else extDirMore = true;
+  extDirEnd = addr + len;
+  // the old copy is only deleted once the new one is written
+  if (old != EXTERNAL_EEPROM_SIZE)
+    removeExtFile(old);
+  touchExtDir();
   return true;
 }
 
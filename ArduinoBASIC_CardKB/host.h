@@ -20,9 +20,18 @@
 #define EXTERNAL_EEPROM         1
 #define EXTERNAL_EEPROM_ADDR    0x50    // I2C address (7 bits)
 #define EXTERNAL_EEPROM_SIZE    32768   // only <=32k tested (64k might work?)
+#define EXT_DIR_FILES           16      // files indexed in RAM, 5 bytes each (+5 bytes)
 
 #define MAGIC_AUTORUN_NUMBER    0xFC
 
+// GRAPHICS 0...NONE 1...PLOT,UNPLOT,LINE,RECT,POINT
+// the pixel buffer takes OLED_WIDTH*OLED_ROWMAX bytes of RAM (512 for 128x32,
+// 1024 for 128x64), so MEMORY_SIZE in basic.h may need lowering to fit
+#define GRAPHICS                0
+
+// SPRITES 0...NONE n...number of sprites (SPRITE, HIT), 11 bytes of RAM each
+#define SPRITES                 0
+
 void host_init(void);
 void host_sleep(long ms);
 void host_digitalWrite(int pin, int state);
@@ -33,6 +42,19 @@ void host_click();
 void host_startupTone();
 void host_cls();
 void host_showBuffer();
+void host_setRefresh(uint16_t hz);
+#if GRAPHICS
+void host_plot(int x, int y, uint8_t on);
+void host_line(int x1, int y1, int x2, int y2, uint8_t on);
+void host_rect(int x1, int y1, int x2, int y2, uint8_t on);
+uint8_t host_point(int x, int y);
+#endif
+#if SPRITES
+void host_defineSprite(uint8_t n, const char *hex);
+void host_moveSprite(uint8_t n, int x, int y);
+uint8_t host_spriteHit(uint8_t a, uint8_t b);
+#endif
+void host_flushSync();
 void host_moveCursor(uint8_t x, uint8_t y);
 void host_outputString(char *str);
 void host_outputProgMemString(const char *str);
@@ -45,10 +67,12 @@ void host_newLine();
 void host_newLine(bool pause);
 char *host_readLine();
 char host_getKey();
+extern volatile bool escTyped;  // set by the key scan, test it before host_ESCPressed()
 bool host_ESCPressed();
-void host_outputFreeMem(unsigned int val);
-void host_saveProgram(bool autoexec);
-void host_loadProgram();
+void host_outputFreeMem(uint16_t val);
+bool host_saveProgram(bool autoexec);
+bool host_loadProgram();
+bool host_autorun();
 void host_LED(uint8_t r, uint8_t g, uint8_t b);
 void host_Img(uint8_t *imgBuff);
 
@@ -58,6 +82,7 @@ void host_directoryExtEEPROM();
 bool host_saveExtEEPROM(char *fileName);
 bool host_loadExtEEPROM(char *fileName);
 bool host_removeExtEEPROM(char *fileName);
+void host_compactExtEEPROM();
 #endif
 
 #endif
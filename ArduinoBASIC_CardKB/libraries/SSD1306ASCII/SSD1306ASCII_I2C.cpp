@@ -16,29 +16,57 @@
 #include "font5x7.c"
 
 //------------------------------------------------------------------------------
-// clear the screen
-void SSD1306ASCII::clear() {
-  uint8_t wkCnt;
-  for (row_ = 0; row_ < OLED_ROWMAX; row_++) {
-    setCursor(0, row_);
-    col_ = OLED_WIDTH;
-    wkCnt = 1;
-    while (col_--) {
-      if (wkCnt == 1) {
-        Wire.endTransmission();
-        Wire.beginTransmission(OLED_ADDR);
-        Wire.write((uint8_t)0x40);
-        wkCnt = WIRE_BUFMAX;
-      }
-      Wire.write(0x00);
-      wkCnt--;
-    }
+// send display data, a 0x40 control byte then up to WIRE_BUFMAX - 1 bytes
+// per transmission
+void SSD1306ASCII::dataByte(uint8_t d) {
+  if (burst_ == 0) {
+    Wire.beginTransmission(OLED_ADDR);
+    Wire.write((uint8_t)0x40);
+    burst_ = WIRE_BUFMAX - 1;
+  }
+  Wire.write(d);
+  if (--burst_ == 0)
+    Wire.endTransmission();
+}
+//------------------------------------------------------------------------------
+// finish any partly filled data transmission
+void SSD1306ASCII::endData() {
+  if (burst_) {
     Wire.endTransmission();
+    burst_ = 0;
   }
+}
+//------------------------------------------------------------------------------
+// clear the screen, and the display RAM pages kept for scrolling
+void SSD1306ASCII::clear() {
+  uint8_t page, x;
+  for (page = 0; page < OLED_PAGES; page++) {
+    setAddress(page, 0);
+    for (x = 0; x < OLED_WIDTH; x++)
+      dataByte(0x00);
+    endData();
+  }
+  top_ = 0;
+  setStartLine();
   col_ = 0;
   row_ = 0;
 }
 //------------------------------------------------------------------------------
+// move the picture up by changing the display start line
+// the new bottom rows show whatever was left in their pages, so they need drawing
+void SSD1306ASCII::scrollUp(uint8_t rows) {
+  top_ = (top_ + rows) % OLED_PAGES;
+  setStartLine();
+}
+//------------------------------------------------------------------------------
+// show the top_ page at the top of the display
+void SSD1306ASCII::setStartLine() {
+  Wire.beginTransmission(OLED_ADDR);
+  Wire.write(0x00);
+  Wire.write(0x40 | (top_ * 8)); // Set Display Start Line 0x40-0x7F
+  Wire.endTransmission();
+}
+//------------------------------------------------------------------------------
 // send a command
 void SSD1306ASCII::commandList(const uint8_t *c, uint8_t n) {
   uint8_t wkCnt = 1;
@@ -80,7 +108,7 @@ void SSD1306ASCII::init() {
     0x1F, //  -> 0x1F - 0x3F
     0x22, // Set page address
     0x00, //  -> Page start address 0
-    0x04, //  -> 0x04:Page end address 4  0x07:Page end address 7
+    0x07, //  -> 0x07:Page end address 7, all pages are used when scrolling
 #else
     0x22, // Set page address
     0x00, //  -> Page start address 0
@@ -121,26 +149,26 @@ void SSD1306ASCII::setCursor(uint8_t col, uint8_t row) {
   col *= 6;
   col += 2;
 
+  setAddress((row + top_) % OLED_PAGES, col);
+}
+//------------------------------------------------------------------------------
+void SSD1306ASCII::setAddress(uint8_t page, uint8_t x) {
   Wire.beginTransmission(OLED_ADDR);
   Wire.write(0x00);
-  Wire.write(0xB0 + row);
+  Wire.write(0xB0 + page);
   Wire.write(0x00);
-  Wire.write((col >> 4) | 0x10);
+  Wire.write((x >> 4) | 0x10);
   Wire.write(0x00);
-  Wire.write(col & 0x0f);
+  Wire.write(x & 0x0f);
   Wire.endTransmission();
 }
 //------------------------------------------------------------------------------
 void SSD1306ASCII::setImg(const uint8_t* c) {
   uint8_t i;
   setCursor(col_, row_);
-  for (i = 0; i < 6; i++) {
-    Wire.endTransmission();
-    Wire.beginTransmission(OLED_ADDR);
-    Wire.write((uint8_t)0x40);
-    Wire.write(*(c + i));
-  }
-  Wire.endTransmission();
+  for (i = 0; i < 6; i++)
+    dataByte(*(c + i));
+  endData();
 }
 //------------------------------------------------------------------------------
 size_t SSD1306ASCII::write(const uint8_t c) {
@@ -161,3 +189,33 @@ size_t SSD1306ASCII::write(const char* s) {
   while(s[i])write(s[i++]);
   return i;
 }
+//------------------------------------------------------------------------------
+// draw n characters of a row from col, setting the cursor only once
+// characters outside the font are drawn as spaces
+// overlay, if given, holds the pixels ORed over the display columns sent,
+// which start with the two columns left of the text when col is 0
+void SSD1306ASCII::writeRow(uint8_t row, uint8_t col, const uint8_t* s, uint8_t n, const uint8_t* overlay) {
+  uint8_t i, j, c, d;
+  if (col >= OLED_COLMAX) return;
+  if (n > OLED_COLMAX - col) n = OLED_COLMAX - col;
+  if (overlay && col == 0) {
+    row_ = row;
+    col_ = 0;
+    setAddress((row + top_) % OLED_PAGES, 0);
+    dataByte(*overlay++);
+    dataByte(*overlay++);
+  }
+  else
+    setCursor(col, row);
+  for (i = 0; i < n; i++) {
+    c = s[i];
+    if ( c < 0x20 || 0x7F < c) c = ' ';
+    for (j = 0; j < 6; j++) {
+      d = (j < 5) ? pgm_read_byte(&font[(c - 0x20) * 5 + j]) : 0x00;
+      if (overlay) d |= *overlay++;
+      dataByte(d);
+    }
+  }
+  endData();
+  col_ += n;
+}
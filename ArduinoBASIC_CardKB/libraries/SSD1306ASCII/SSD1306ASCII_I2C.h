@@ -29,6 +29,7 @@
 #define OLED_COLMAX 21
 #define OLED_ROWMAX 4
 //#define OLED_ROWMAX 8
+#define OLED_PAGES  8   // pages of display RAM, used as a ring when scrolling
 
 #define BLACK       0 ///< Draw 'off' pixels
 #define WHITE       1 ///< Draw 'on' pixels
@@ -46,8 +47,18 @@ class SSD1306ASCII {
   void commandList(const uint8_t *c, uint8_t n);
   size_t write(const uint8_t c);
   size_t write(const char* s);
+  void writeRow(uint8_t row, uint8_t col, const uint8_t* s, uint8_t n, const uint8_t* overlay = NULL);
+  void scrollUp(uint8_t rows = 1);
  private:
+  void setAddress(uint8_t page, uint8_t x);
+  void setStartLine();
+  void dataByte(uint8_t d);
+  void endData();
   // cursor position
   int8_t col_, row_;
+  // display RAM page shown as the top row
+  uint8_t top_;
+  // data bytes left in the current I2C transmission, 0 if none is open
+  uint8_t burst_;
 };
 #endif
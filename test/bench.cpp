@@ -0,0 +1,123 @@
+// The interpreter alone on Linux, for timing programs: each line of the file
+// is typed at the prompt, output goes to stdout and the time each RUN takes
+// to stderr. The screen, keyboard and EEPROM calls do nothing.
+// With -t it times tokenize() instead, over every line of the files.
+#include <time.h>
+#include "basic.h"
+#include "host.h"
+
+uint8_t mem[MEMORY_SIZE];
+#define TOKEN_BUF_SIZE    64
+uint8_t tokenBuf[TOKEN_BUF_SIZE];
+volatile bool escTyped = false;
+
+void host_init() {}
+void host_sleep(int32_t) {}
+void host_digitalWrite(int, int) {}
+int host_digitalRead(int) { return 0; }
+int host_analogRead(int pin) { return pin; }
+void host_pinMode(int, int) {}
+void host_click() {}
+void host_startupTone() {}
+void host_cls() {}
+void host_showBuffer() {}
+void host_setRefresh(uint16_t) {}
+void host_plot(int, int, uint8_t) {}
+void host_line(int, int, int, int, uint8_t) {}
+void host_rect(int, int, int, int, uint8_t) {}
+uint8_t host_point(int, int) { return 0; }
+void host_defineSprite(uint8_t, const char *) {}
+void host_moveSprite(uint8_t, int, int) {}
+uint8_t host_spriteHit(uint8_t, uint8_t) { return 0; }
+void host_flushSync() {}
+void host_moveCursor(uint8_t, uint8_t) {}
+void host_outputString(char *str) { fputs(str, stdout); }
+void host_outputProgMemString(const char *str) { fputs(str, stdout); }
+void host_outputChar(char c) { putchar(c); }
+void host_outputChar(char c, bool) { putchar(c); }
+char *host_floatToStr(float f, char *buf) {
+  if (f == (int32_t)f && fabsf(f) < 1e9f) sprintf(buf, "%ld", (long)f);
+  else sprintf(buf, "%g", f);
+  return buf;
+}
+void host_outputFloat(float f) { char buf[32]; fputs(host_floatToStr(f, buf), stdout); }
+int host_outputInt(int32_t val) { return printf("%ld", (long)val); }
+void host_newLine() { putchar('\n'); }
+void host_newLine(bool) { putchar('\n'); }
+char *host_readLine() { return NULL; }
+char host_getKey() { return 0; }
+bool host_ESCPressed() { return false; }
+void host_outputFreeMem(uint16_t val) { printf("%u bytes free\n", val); }
+bool host_saveProgram(bool) { return true; }
+bool host_loadProgram() { return false; }
+bool host_autorun() { return false; }
+void host_LED(uint8_t, uint8_t, uint8_t) {}
+void host_Img(uint8_t *) {}
+void writeExtEEPROM(uint16_t, uint8_t) {}
+void host_directoryExtEEPROM() {}
+bool host_saveExtEEPROM(char *) { return true; }
+bool host_loadExtEEPROM(char *) { return true; }
+bool host_removeExtEEPROM(char *) { return true; }
+void host_compactExtEEPROM() {}
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// tokenize the lines of the files over and over for a second, and print how
+// many lines a second that is
+#define TOKENIZE_LINES    1000
+int tokenizeBench(int files, char **names) {
+  static char lines[TOKENIZE_LINES][256];
+  int n = 0;
+  for (int i = 0; i < files; i++) {
+    FILE *f = fopen(names[i], "r");
+    if (!f) { perror(names[i]); return 2; }
+    while (n < TOKENIZE_LINES && fgets(lines[n], sizeof lines[n], f)) {
+      lines[n][strcspn(lines[n], "\r\n")] = 0;
+      if (lines[n][0]) n++;
+    }
+    fclose(f);
+  }
+  if (n == 0) return 2;
+  long count = 0;
+  double t0 = now(), t;
+  do {
+    for (int i = 0; i < n; i++) {
+      int ret = tokenize((unsigned char *)lines[i], tokenBuf, TOKEN_BUF_SIZE);
+      if (ret != ERROR_NONE) { printf("%s: %s\n", lines[i], errorTable[ret]); return 1; }
+    }
+    count += n;
+  } while ((t = now() - t0) < 1.0);
+  printf("%.0f lines/s\n", count / t);
+  return 0;
+}
+
+// bench [program.bas]
+// bench -t file...
+int main(int argc, char **argv) {
+  if (argc > 1 && !strcmp(argv[1], "-t"))
+    return tokenizeBench(argc - 2, argv + 2);
+  FILE *f = argc > 1 ? fopen(argv[1], "r") : stdin;
+  if (!f) { perror(argv[1]); return 2; }
+  char line[256];
+  reset();
+  while (fgets(line, sizeof line, f)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (!line[0]) continue;
+    double t0 = now();
+    int ret = tokenize((unsigned char *)line, tokenBuf, TOKEN_BUF_SIZE);
+    if (ret == ERROR_NONE) ret = processInput(tokenBuf);
+    double t1 = now();
+    if (ret != ERROR_NONE) {
+      putchar('\n');
+      if (lineNumber) printf("%d-", lineNumber);
+      printf("%s\n", errorTable[ret]);
+    }
+    if (!strcasecmp(line, "run"))
+      fprintf(stderr, "%.3f s\n", t1 - t0);
+  }
+  return 0;
+}
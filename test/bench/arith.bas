@@ -0,0 +1,7 @@
+10 a=1.5:b=2.25:c=0:t=0
+20 for i=1 to 1000000
+30 c=(a*b+i)/(a+b)-i*0.5+a*a-b*b
+40 t=t+c*2-(c+1)/3
+50 next i
+60 print t
+run
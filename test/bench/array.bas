@@ -0,0 +1,6 @@
+10 dim a(20)
+20 for i=1 to 1000000
+30 j=i mod 20+1: a(j)=a(j)+j*2-1
+40 next i
+50 print a(5)
+run
@@ -0,0 +1,9 @@
+5 dim m(20)
+10 s=0:x=0
+20 for i=1 to 30000
+30 if x>0 and m(int(i/2000)+1)>0 then s=s+1
+35 if x<0 and sqrt(i)>2 then s=s+1
+40 if x=0 or m(3)=1 or sin(i)>2 then s=s+1
+50 next i
+60 print s
+run
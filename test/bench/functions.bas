@@ -0,0 +1,6 @@
+10 s=0
+20 for i=1 to 1000000
+30 s=s+sqrt(i)*sin(i/100)-int(i/7)
+40 next i
+50 print s
+run
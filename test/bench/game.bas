@@ -0,0 +1,8 @@
+10 x=0:y=0:vx=1.5:vy=0.5
+20 for i=1 to 300000
+30 x=x+vx: y=y+vy
+40 if x>100 or x<0 then vx=-vx
+50 if y>50 or y<0 then vy=-vy
+60 next i
+70 print x;" ";y
+run
@@ -0,0 +1,11 @@
+5 dim a(100):dim b$(3,4)
+10 x=0:y=0:z=0:s$="hello world"
+20 for r=1 to 3000
+30 d=0:gosub 100
+40 next r
+50 print d;" ";x
+60 stop
+100 d=d+1:x=x+1
+110 if d<25 then gosub 100
+120 return
+run
@@ -0,0 +1,8 @@
+10 s%=0
+15 for j%=1 to 30
+20 for i%=1 to 20000
+30 s%=s%+i% mod 13*3-1
+40 next i%
+45 next j%
+50 print s%
+run
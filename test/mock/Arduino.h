@@ -0,0 +1,61 @@
+// Arduino core for the Linux simulation: the registers and calls the sketch uses
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <avr/pgmspace.h>
+typedef uint8_t byte;
+typedef bool boolean;
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t TCNT1;
+extern volatile uint8_t DDRB, DDRD, PORTB, PORTD, DDRC, PORTC;
+// the keyboard matrix columns, read from the scripted key presses
+uint8_t sim_pinb();
+uint8_t sim_pind();
+#define PINB sim_pinb()
+#define PIND sim_pind()
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define TOIE1 0
+#define ISR(v, ...) void v(void)
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+// SREG only holds the interrupt flag
+struct SimSREG {
+  uint8_t get();
+  void set(uint8_t);
+  operator uint8_t() { return get(); }
+  SimSREG &operator=(uint8_t v) { set(v); return *this; }
+};
+extern SimSREG SREG;
+void sim_noInterrupts();
+void sim_interrupts();
+#define cli() sim_noInterrupts()
+#define sei() sim_interrupts()
+#define noInterrupts() sim_noInterrupts()
+#define interrupts() sim_interrupts()
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis();
+unsigned long micros();
+void pinMode(int, int);
+void digitalWrite(int, int);
+int digitalRead(int);
+int analogRead(int);
+char *dtostre(double, char*, unsigned char, unsigned char);
+char *dtostrf(double, signed char, unsigned char, char*);
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+// the ATmega328P's 1KB EEPROM, counting the bytes written
+struct EEPROMClass {
+  uint8_t data[1024];
+  long writes;
+  uint8_t read(int a) { return data[a]; }
+  void write(int a, uint8_t v) { data[a] = v; writes++; }
+  void update(int a, uint8_t v) { if (data[a] != v) write(a, v); }
+  int length() { return sizeof data; }
+};
+extern EEPROMClass EEPROM;
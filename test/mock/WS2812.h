@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+// one LED, sync() takes the 30us the real one spends with interrupts off
+struct cRGB { uint8_t g, r, b; };
+class WS2812 {
+ public:
+  WS2812(uint16_t) {}
+  uint8_t set_crgb_at(uint16_t, cRGB) { return 0; }
+  void setOutput(uint8_t) {}
+  void sync();
+};
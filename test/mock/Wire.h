@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+// an SSD1306 at 0x3C and a 24LC256 at 0x50, with the AVR Wire library's 32 byte buffer
+struct MockWire {
+  long transactions, bytes, oledTransactions, oledBytes, eepromWrites;
+  uint8_t ram[8][128];
+  int page, col;
+  uint8_t startLine;
+  uint8_t ext[32768];
+  uint16_t extAddr;
+  uint8_t addr, buf[32];
+  int n;
+  uint8_t rx[32];
+  int rxn, rxi;
+  void begin() {}
+  void setClock(long) {}
+  void beginTransmission(uint8_t a) { addr = a; n = 0; }
+  size_t write(uint8_t b) {
+    if (n >= 32) { fprintf(stderr, "Wire buffer overflow\n"); exit(3); }
+    buf[n++] = b;
+    return 1;
+  }
+  uint8_t endTransmission(bool stop = true);
+  uint8_t requestFrom(uint8_t a, uint8_t q);
+  int available() { return rxn - rxi; }
+  int read() { return rxi < rxn ? rx[rxi++] : -1; }
+};
+extern MockWire Wire;
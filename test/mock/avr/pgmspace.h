@@ -0,0 +1,7 @@
+#pragma once
+#include <stdint.h>
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_byte_near(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(p))
+#define pgm_read_word_near(p) (*(p))
@@ -0,0 +1,409 @@
+// Linux simulation of the sketch: the timer 1 interrupt, an I2C bus with an
+// SSD1306 and a 24LC256 on it, the internal EEPROM and the CardKB key matrix.
+//
+// The script is typed on the key matrix a line at a time, with Enter after
+// each line unless it ends in \. Lines starting with # are comments, and
+// these lines are commands instead:
+//   @panel          print the panel once the flush has caught up
+//   @check NAME     compare the panel with the screen buffer (and pixels)
+//   @idle MS        type nothing for a while
+//   @key N          type character N
+//   @esc            type ESC, also while a program runs
+//   @type TEXT      type TEXT while a program runs
+//   @pix X0 X1      print the pixels of columns X0 to X1
+//   @eewrites       print the bytes written to the EEPROM and the page
+//                   writes to the external one
+//   @extswap        replace the external EEPROM with a blank chip
+//   @oldsave [+]    write the program to the internal EEPROM as SAVE (SAVE+)
+//                   did before the images, autorun byte, length and program
+//   @stats NAME     print the time and I2C traffic since the last @stats
+//                   to stderr
+// At the end the panel and the number of failed checks are printed.
+#include <Arduino.h>
+#include <Wire.h>
+#include <EEPROM.h>
+#include <WS2812.h>
+#include "font5x7.c"
+#include "host.h"
+#include "cardkb.h"
+#include <signal.h>
+#include <unistd.h>
+
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t TCNT1;
+volatile uint8_t DDRB, DDRD, PORTB, PORTD, DDRC, PORTC;
+MockWire Wire;
+EEPROMClass EEPROM;
+extern uint8_t screenBuffer[], curX, curY, inputMode;
+extern uint8_t mem[];
+extern int sysPROGEND;
+
+void setup();
+void loop();
+void TIMER1_OVF_vect(void);
+
+// ---- time and the timer interrupt ----
+static double simUs;          // simulated time
+static double nextTimer1;
+static uint8_t irqOff;
+static bool inIsr;
+static double busUs;          // time spent on I2C
+void sim_noInterrupts() { irqOff = 1; }
+void sim_interrupts() { irqOff = 0; }
+uint8_t SimSREG::get() { return irqOff; }
+void SimSREG::set(uint8_t v) { irqOff = v; }
+SimSREG SREG;
+
+static void matrixDrive();
+static void advance(double us) {
+  simUs += us;
+  matrixDrive();
+  if (irqOff || inIsr) return;
+  inIsr = true;   // the ISR is ISR_NOBLOCK, but never nests with itself here
+  while (simUs >= nextTimer1) {
+    if (!(TIMSK1 & (1 << TOIE1))) { nextTimer1 = simUs; break; }   // not started yet
+    TIMER1_OVF_vect();
+    nextTimer1 += (65536 - TCNT1) * 64 / 8.0;   // 64 prescaler at 8MHz
+  }
+  inIsr = false;
+}
+
+void delay(unsigned long ms) { advance(ms * 1000.0); }
+void delayMicroseconds(unsigned int us) { advance(us); }
+unsigned long millis() { return (unsigned long)(simUs / 1000); }
+unsigned long micros() { return (unsigned long)simUs; }
+void pinMode(int, int) {}
+void digitalWrite(int, int) {}
+int digitalRead(int) { return 0; }
+int analogRead(int p) { return p; }
+char *dtostre(double v, char *buf, unsigned char prec, unsigned char) { sprintf(buf, "%.*E", prec, v); return buf; }
+char *dtostrf(double v, signed char w, unsigned char prec, char *buf) { sprintf(buf, "%*.*f", w, prec, v); return buf; }
+
+void WS2812::sync() {
+  advance(30);
+}
+
+// ---- I2C ----
+static int oledMux = 32;
+static uint8_t displayOffset;
+static int cmdArgs(uint8_t c) {
+  switch (c) {
+    case 0x81: case 0xA8: case 0xD3: case 0xDA: case 0x20: case 0x8D: case 0xD5: case 0xD9: case 0xDB: return 1;
+    case 0x21: case 0x22: case 0xA3: return 2;
+    case 0x29: case 0x2A: return 5;
+    case 0x26: case 0x27: return 6;
+    default: return 0;
+  }
+}
+static void oledCommand(uint8_t c) {
+  static int pendingArgs;
+  static uint8_t pendingCmd;
+  if (pendingArgs) {
+    if (pendingCmd == 0xA8) oledMux = c + 1;
+    if (pendingCmd == 0xD3) displayOffset = c & 63;
+    pendingArgs--;
+    return;
+  }
+  if ((c & 0xF8) == 0xB0) Wire.page = c & 7;
+  else if (c < 0x10) Wire.col = (Wire.col & 0xF0) | c;
+  else if (c < 0x20) Wire.col = (Wire.col & 0x0F) | ((c & 0x0F) << 4);
+  else if (c >= 0x40 && c < 0x80) Wire.startLine = c & 63;
+  else { pendingArgs = cmdArgs(c); pendingCmd = c; }
+}
+
+static double eepromBusyUntil;
+uint8_t MockWire::endTransmission(bool) {
+  double us = 20 + (n + 1) * 22.5;	// start/stop and library overhead, 9 bits/byte at 400kHz
+  transactions++; bytes += n + 1; busUs += us;
+  if (addr == 0x3C) {
+    oledTransactions++; oledBytes += n + 1;
+    if (n && buf[0] == 0x40) {
+      for (int i = 1; i < n; i++) {
+        ram[page & 7][col & 127] = buf[i];
+        if (++col == 128) { col = 0; page++; }
+      }
+    }
+    else if (n && (buf[0] & 0x7F) == 0x00) {
+      for (int i = 1; i < n; i++) oledCommand(buf[i]);
+    }
+  }
+  else if (addr >= 0x50 && addr < 0x58) {
+    if (simUs < eepromBusyUntil) { advance(us); n = 0; return 2; }	// NACK while writing
+    if (n >= 2) extAddr = (buf[0] << 8) | buf[1];
+    if (n > 2) {
+      // a page write wraps within its 64 byte page
+      for (int i = 2; i < n; i++) ext[(extAddr & ~63) | ((extAddr + i - 2) & 63)] = buf[i];
+      eepromWrites++;
+      eepromBusyUntil = simUs + us + 5000;
+    }
+  }
+  advance(us);
+  n = 0;
+  return 0;
+}
+uint8_t MockWire::requestFrom(uint8_t, uint8_t q) {
+  double us = 20 + (q + 1) * 22.5;
+  transactions++; bytes += q + 1; busUs += us;
+  rxn = rxi = 0;
+  if (simUs < eepromBusyUntil) { advance(us); return 0; }
+  for (int i = 0; i < q && i < 32; i++) rx[rxn++] = ext[(extAddr++) & 32767];
+  advance(us);
+  return rxn;
+}
+
+// ---- panel ----
+static int pageOfRow(int r) { return ((r * 8 + Wire.startLine + displayOffset) & 63) / 8; }
+static bool onPages() { return !((Wire.startLine + displayOffset) & 7); }   // rows line up with pages
+static char decodeCell(int page, int x) {
+  for (int c = 0x20; c < 0x80; c++) {
+    if (!memcmp(&Wire.ram[page][x], &font[(c - 0x20) * 5], 5)) return c == 0x7f ? '#' : c;
+  }
+  return '?';
+}
+static void dumpPanel() {
+  printf("+---------------------+\n");
+  for (int r = 0; r < oledMux / 8; r++) {
+    if (!onPages()) { printf("|(start line not on a page)\n"); continue; }
+    printf("|");
+    for (int c = 0; c < 21; c++) putchar(decodeCell(pageOfRow(r), 2 + c * 6));
+    printf("|\n");
+  }
+  printf("+---------------------+\n");
+}
+static void dumpPixels(int x0, int x1) {
+  for (int r = 0; r < oledMux / 8; r++) {
+    for (int b = 0; b < 8; b++) {
+      printf("%2d ", r * 8 + b);
+      for (int x = x0; x <= x1; x++) putchar(Wire.ram[pageOfRow(r)][x] & (1 << b) ? '#' : '.');
+      putchar('\n');
+    }
+  }
+}
+
+// The panel must show the screen buffer, apart from the cursor. With
+// GRAPHICS every column must be the glyph ORed with the pixels and sprites.
+static int checks, checkFails;
+void buildOverlay(uint8_t y, uint8_t px, uint8_t count, uint8_t *over) __attribute__((weak));
+static void checkPanel(const char *where) {
+  checks++;
+  for (int r = 0; r < oledMux / 8; r++) {
+    int page = pageOfRow(r);
+    for (int x = 0; x < 128; x++) {
+      int c = x < 2 ? 0 : (x - 2) / 6, j = x < 2 ? 5 : (x - 2) % 6;
+      if (c >= 21 || (inputMode && r == curY && c == curX)) continue;
+      uint8_t ch = screenBuffer[r * 21 + c];
+      if (ch < 0x20 || ch > 0x7f) ch = ' ';
+      uint8_t over = 0;
+      if (buildOverlay) buildOverlay(r, x, 1, &over);
+      uint8_t want = (j < 5 ? font[(ch - 0x20) * 5 + j] : 0) | over;
+      if (!onPages() || Wire.ram[page][x] != want) {
+        printf("panel mismatch at %s row %d x %d: %02x shown, %02x wanted\n", where, r, x, Wire.ram[page][x], want);
+        checkFails++;
+        dumpPanel();
+        return;
+      }
+    }
+  }
+}
+
+// ---- keyboard script ----
+static FILE *script;
+static const char *eepromOut;
+static char lineBuf[512];
+static const char *pending;           // rest of a line being typed
+static bool peeked, noEnter;
+static bool released = true;
+static double idleUntil = -1;
+static char checkWhere[64];
+static bool panelDue;
+static double dueUs;                  // give the background flush time to finish before looking
+static double markUs, markBus;
+static long markTr, markBytes;
+
+static void stats(const char *label) {
+  fprintf(stderr, "[%s] %.1f ms, oled %ld transactions %ld bytes, bus %.1f ms\n",
+          label, (simUs - markUs) / 1000, Wire.oledTransactions - markTr, Wire.oledBytes - markBytes, (busUs - markBus) / 1000);
+  markUs = simUs; markBus = busUs; markTr = Wire.oledTransactions; markBytes = Wire.oledBytes;
+}
+
+static bool nextLine() {
+  if (peeked) { peeked = false; return true; }
+  if (!fgets(lineBuf, sizeof lineBuf, script)) return false;
+  lineBuf[strcspn(lineBuf, "\r\n")] = 0;
+  return true;
+}
+
+static void finish() {
+  advance(100000);
+  dumpPanel();
+  printf("%d panel checks, %d failed\n", checks, checkFails);
+  if (eepromOut) {
+    FILE *f = fopen(eepromOut, "wb");
+    fwrite(EEPROM.data, 1, sizeof EEPROM.data, f);
+    fclose(f);
+  }
+  exit(checkFails ? 1 : 0);
+}
+
+// the next character the script types, 0 for none yet
+static uint8_t scriptKey() {
+  if ((checkWhere[0] || panelDue) && inputMode) {
+    if (simUs < dueUs) return 0;
+    if (panelDue) dumpPanel();
+    if (checkWhere[0]) checkPanel(checkWhere);
+    checkWhere[0] = 0;
+    panelDue = false;
+  }
+  if (!released) { released = true; return 0; }   // a gap between keys
+  if (idleUntil >= 0) {
+    if (simUs < idleUntil) return 0;
+    idleUntil = -1;
+  }
+  // while a program runs only @esc, @type and @idle lines get through
+  if (!inputMode && !pending) {
+    if (!nextLine()) return 0;
+    peeked = true;
+    if (!strncmp(lineBuf, "@idle ", 6)) { idleUntil = simUs + atof(lineBuf + 6) * 1000; peeked = false; return 0; }
+    if (!strncmp(lineBuf, "@type ", 6)) {
+      static int typed;
+      if (lineBuf[6 + typed]) { released = false; return lineBuf[6 + typed++]; }
+      typed = 0; peeked = false; return 0;
+    }
+    if (strncmp(lineBuf, "@esc", 4)) return 0;
+    peeked = false;
+    released = false;
+    return 27;
+  }
+  while (!pending || !*pending) {
+    if (pending) {
+      pending = NULL;
+      if (noEnter) { noEnter = false; continue; }
+      released = false;
+      return 13;
+    }
+    if (!nextLine()) finish();
+    if (!lineBuf[0] || lineBuf[0] == '#') continue;   // blank lines and comments
+    if (!strncmp(lineBuf, "@idle ", 6)) { idleUntil = simUs + atof(lineBuf + 6) * 1000; return 0; }
+    if (!strncmp(lineBuf, "@stats", 6)) { stats(lineBuf + 7); continue; }
+    if (!strncmp(lineBuf, "@eewrites", 9)) {
+      printf("eeprom writes %ld, external eeprom page writes %ld\n", EEPROM.writes, Wire.eepromWrites);
+      continue;
+    }
+    if (!strncmp(lineBuf, "@extswap", 8)) {   // another, blank chip
+      memset(Wire.ext, 0, sizeof Wire.ext);
+      Wire.ext[EXTERNAL_EEPROM_SIZE - 1] = 0x5A;
+      continue;
+    }
+    if (!strncmp(lineBuf, "@oldsave", 8)) {
+      EEPROM.data[0] = lineBuf[9] == '+' ? MAGIC_AUTORUN_NUMBER : 0;
+      EEPROM.data[1] = sysPROGEND & 0xFF;
+      EEPROM.data[2] = sysPROGEND >> 8;
+      memcpy(&EEPROM.data[3], mem, sysPROGEND);
+      continue;
+    }
+    if (!strncmp(lineBuf, "@pix", 4)) {
+      int a = 0, b = 40;
+      sscanf(lineBuf + 4, "%d %d", &a, &b);
+      advance(100000);
+      dumpPixels(a, b);
+      continue;
+    }
+    if (!strncmp(lineBuf, "@panel", 6)) { panelDue = true; dueUs = simUs + 100000; return 0; }
+    if (!strncmp(lineBuf, "@check", 6)) {
+      // checked on the next poll, once the host has had a chance to draw
+      snprintf(checkWhere, sizeof checkWhere, "%.63s", lineBuf + 6);
+      dueUs = simUs + 100000;
+      return 0;
+    }
+    if (!strncmp(lineBuf, "@esc", 4)) { released = false; return 27; }
+    if (!strncmp(lineBuf, "@key ", 5)) { released = false; return atoi(lineBuf + 5); }
+    pending = lineBuf;
+    // a line ending in \ is typed without pressing enter
+    size_t len = strlen(lineBuf);
+    if (len && lineBuf[len - 1] == '\\') { lineBuf[len - 1] = 0; noEnter = true; }
+  }
+  released = false;
+  return *pending++;
+}
+
+// ---- key matrix: script characters become timed key presses ----
+static int mKey, mMods, mPhase, mTarget, mTargetMods;	// mKey 1..48 held, mMods 1 shift 2 sym
+static double mNext;
+static double holdUs = 20000, gapUs = 10000;
+static bool mapKey(uint8_t c) {
+  static const int modes[] = {0, 1, 3};
+  for (int m = 0; m < 3; m++)
+    for (int k = 0; k < 48; k++)
+      if (KeyMap[k][modes[m]] == c) { mTarget = k + 1; mTargetMods = m; return true; }
+  fprintf(stderr, "no key for %d\n", c);
+  return false;
+}
+static bool rowActive(int key) { return !(PORTC & (0x08 >> ((key - 1) / 12))); }
+uint8_t sim_pind() {
+  if (mKey && (mKey - 1) % 12 < 8 && rowActive(mKey)) return 0xFF & ~(1 << ((mKey - 1) % 12));
+  return 0xFF;
+}
+uint8_t sim_pinb() {
+  uint8_t v = 0xDF;
+  if (mKey && (mKey - 1) % 12 >= 8 && rowActive(mKey)) v &= ~(1 << ((mKey - 1) % 12 - 8));
+  if (mMods & 1) v &= ~0x10;
+  if (mMods & 2) v &= ~0x80;
+  return v;
+}
+static void matrixDrive() {
+  static bool busy;
+  if (busy) return;
+  busy = true;
+  while (simUs >= mNext) {
+    switch (mPhase) {
+      case 0: {   // press the next key, with its modifier first
+        uint8_t c = scriptKey();
+        if (!c || !mapKey(c)) { mNext = simUs + 1000; break; }
+        if (mTargetMods) { mMods = mTargetMods; mPhase = 1; }
+        else { mKey = mTarget; mPhase = 2; }
+        mNext = simUs + holdUs;
+        break;
+      }
+      case 1: mMods = 0; mPhase = 3; mNext = simUs + gapUs; break;	// modifier released
+      case 3: mKey = mTarget; mPhase = 2; mNext = simUs + holdUs; break;
+      case 2: mKey = 0; mPhase = 0; mNext = simUs + gapUs; break;	// key released
+    }
+  }
+  busy = false;
+}
+
+// The Makefile renames these in cardkb.cpp, so polling the keyboard and
+// running a line of BASIC take simulated time.
+byte cardkb_getChar(void);
+bool cardkb_escPressed(void);
+byte cardkb_getKey(void);
+static const double keyUs = 100;
+byte getKey(void) { advance(keyUs); return cardkb_getKey(); }
+byte getChar(void) { advance(keyUs); return cardkb_getChar(); }
+bool escPressed(void) { return cardkb_escPressed(); }
+bool simLine() { advance(keyUs); return true; }
+
+static void onAlarm(int) {
+  fprintf(stderr, "timed out\n");
+  _exit(9);
+}
+
+// sim [-i eeprom.bin] [-o eeprom.bin] [script]
+int main(int argc, char **argv) {
+  int opt;
+  script = stdin;
+  while ((opt = getopt(argc, argv, "i:o:")) != -1) {
+    if (opt == 'i') {
+      FILE *f = fopen(optarg, "rb");
+      if (!f || fread(EEPROM.data, 1, sizeof EEPROM.data, f) != sizeof EEPROM.data) { perror(optarg); return 2; }
+      fclose(f);
+    }
+    else if (opt == 'o') eepromOut = optarg;
+    else return 2;
+  }
+  if (optind < argc && !(script = fopen(argv[optind], "r"))) { perror(argv[optind]); return 2; }
+  signal(SIGALRM, onAlarm);
+  alarm(60);
+  setup();
+  while (1) loop();
+}